@@ -12,7 +12,13 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <malloc.h>
+#include <emmintrin.h>
 #include <Windows.h>
+#include <psapi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /* type def struct for picture data											  */
 typedef struct picture {
@@ -25,31 +31,310 @@ typedef struct picture {
 /* Declare all constant                                                       */
 #define IM_SIZE 256 // maximum image size
 #define FILTER_SIZE 3 // filter size
+#define PICT_ALIGN 64 // byte alignment of pooled picture buffers and rows
+#define NUMA_MAX_NODES 16 // most NUMA nodes used by -pin
+#define NUMA_MAX_THREADS 256 // most threads pinned by -pin
+#define NUMA_PAGE 4096 // page size
+#define NUMA_SAMPLE 64 // pages of a buffer looked at by numa_stats
+#define POOL_SLOTS 16 // maximum buffers kept by one picture pool
+#define OP_CONV 0 // filter job operation, convolution with flt
+#define OP_MEDIAN 1 // median of (2 radius + 1)^2 window
+#define OP_BOX 2 // mean of (2 radius + 1)^2 window
+#define OP_ERODE 3 // min of (2 radius + 1) x (2 radius_y + 1) rectangle
+#define OP_DILATE 4 // max of the rectangle
+#define OP_OPEN 5 // erode then dilate
+#define OP_CLOSE 6 // dilate then erode
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE 0 // 1 = record timeline of every task into TRACE_FILE
+#endif
+#define FIX_MAX_SHIFT 12 // largest 2^shift tried to make the filter integer
+#define FIX_SHIFT 8 // 2^shift used when the filter is not exact
+#define FIX_AUTO 0 // filter job integer path, only if exact
+#define FIX_ALWAYS 1 // always, rounding the filter if needed
+#define FIX_NEVER 2 // never, double as image_filter
+#define TILED_MAGIC "IMT1" // first bytes of a tiled picture file
+#define TILED_SIZE 64 // tile width and height of new tiled files
+#define PYR_MAX 12 // most levels of a pyramid
+#define PYR_MIN 8 // smallest width and height of a pyramid level
+#define TRACE_FILE "trace.json"
+#define TRACE_MAX 4096 // events kept per task
+#define MODE_BANDS 0 // one band per task, filter_bands
+#define MODE_TILES 1 // dynamic tiles handed out by root, filter_tiles
+#define MODE_LOCAL 2 // root alone with job->threads threads
+#define MODE_SHARED 3 // one band per task in shared memory, filter_shared
+#define CALIB_FILE "calibration.txt" // table of fastest mode, see autotune
+#define TUNE_TRIALS 3 // timed runs of every candidate
+#define TAG_TILE 1 // message tags of dynamic tile scheduling
+#define TAG_DONE 2
+#define TAG_DONE_DATA 3
+#define TAG_BAND 4 // filtered band of -stream
+#define TILE_HDR (PICT_ALIGN / (int)sizeof(int)) // ints of tile header
+#define JOB_PATH 260 // maximum file name length in a job
+#define PIPE_NAME "\\\\.\\pipe\\imagpro" // named pipe used by -serve
+#define BENCH_FILE "bench_baseline.txt" // ms of every bench path per host
+#define BENCH_PICT "bench.pgm" // scratch file of the write and read paths
+#define BENCH_REF "new1.pgm" // reference output of original.pgm
+#define BENCH_TRIALS 5 // timed runs of every path, median is kept
+#define BENCH_THRESHOLD 20.0 // default % slower than baseline that fails
+#define BENCH_SIZES 2 // synthetic picture heights
+#define BENCH_PATHS 8 // paths of bench_names[]
+#define BENCH_WRITE 0
+#define BENCH_READ 1
+#define BENCH_CONV 2
+#define BENCH_MEDIAN 3
+#define BENCH_BOX 4
+#define BENCH_SCATTER 5
+#define BENCH_BANDS 6
+#define BENCH_MATVEC 7
 volatile DWORD dwStart;
 
+/* type def struct for picture pool, keeps freed buffers for the next frame	  */
+typedef struct pool_slot {
+	void* ptr;
+	size_t bytes;
+	int used;
+}pool_slot;
+
+typedef struct picture_pool {
+	pool_slot slot[POOL_SLOTS];
+	int nslot;
+	size_t bytes_alloc; // bytes taken from the allocator
+	size_t bytes_reused; // bytes handed out again from released buffers
+	int n_alloc;
+	int n_reuse;
+	int touch; // 1 = new buffers are first touched by the filter threads
+}picture_pool;
+
+/* type def struct for placement of the threads, see numa_pin				  */
+typedef struct numa_place {
+	int pinned; // # of threads pinned, 0 = not pinned
+	int nodes; // # of NUMA nodes
+	int rank; // rank of this task among the tasks on this host
+	int ranks; // # of tasks on this host, 0 = not known yet
+	int core[NUMA_MAX_THREADS]; // core of every OpenMP thread, -1 = none
+	int node[NUMA_MAX_THREADS]; // NUMA node of every OpenMP thread
+}numa_place;
+
+/* type def struct for one filter job, broadcast from root to every worker	  */
+typedef struct filter_job {
+	int quit; // 1 = no more jobs
+	int height; // actual height and width of pict
+	int width;
+	int maxval; // maximum pixel value of pict, from read_pict
+	int op; // OP_CONV, OP_MEDIAN, OP_BOX, OP_ERODE, OP_DILATE, OP_OPEN, OP_CLOSE
+	int radius; // window radius of median and box, half width of morphology
+	int radius_y; // half height of morphology rectangle
+	int threads; // # of threads per task
+	int fixed; // FIX_AUTO, FIX_ALWAYS, FIX_NEVER
+	int mode; // MODE_BANDS, MODE_TILES, MODE_LOCAL, MODE_SHARED
+	int autotune; // 1 = let autotune choose mode, threads and tile
+	int tile; // rows per tile of dynamic scheduling
+	int inflight; // tiles queued per worker in dynamic scheduling
+	int levels; // > 1 = filter a pyramid of levels at root
+	int stream; // 1 = run_job writes out, bands as they arrive
+	int pin; // 1 = pin threads and first touch buffers on their node
+	double flt[FILTER_SIZE][FILTER_SIZE];
+	char in[JOB_PATH]; // input and output file name, root only
+	char out[JOB_PATH];
+}filter_job;
+
+/* type def struct for data of -bench, see bench_run					  */
+typedef struct bench_data {
+	filter_job job; // size of the synthetic picture
+	picture pict; // synthetic picture (root only)
+	picture out; // output of every path (root only)
+	int *mat; // nmat x nmat matrix of matvec (root only)
+	int *vec; // vector of matvec
+	int nmat;
+}bench_data;
+
+/* type def struct for filter scaled to integers, see fixed_kernel			  */
+typedef struct fixed_filter {
+	int k[FILTER_SIZE][FILTER_SIZE]; // filter times 2^shift
+	int shift;
+	int coeff; // sum of k
+	int exact; // 1 = same result as image_filter
+	int lanes16; // 1 = sums fit 16 bit lanes
+}fixed_filter;
+
+/* type def struct for header of tiled picture file, see tiled_access		  */
+typedef struct tiled_header {
+	char magic[4]; // TILED_MAGIC
+	int width; // picture size
+	int height;
+	int tile; // tile width and height
+	int tiles_x; // # of tiles across and down
+	int tiles_y;
+	int depth; // bytes per pixel, 1
+	int reserved;
+}tiled_header;
+
+/* type def struct for window of filter_shared							  */
+typedef struct shared_pict {
+	MPI_Comm node; // tasks on this host
+	MPI_Win win;
+	int *base; // input picture, then output picture, IM_SIZE rows each
+	size_t ints; // size of window
+	int col; // row stride of both pictures
+	int usable; // -1 = not checked, 1 = all tasks on this host
+}shared_pict;
+
+/* type def struct for rows of the picture worked by one task				  */
+typedef struct band {
+	int first; // first row owned
+	int rows; // # of rows owned
+	int top; // # of halo rows above and below
+	int bottom;
+}band;
+
+
+/* type def struct for one begin or end mark of the timeline, see trace_mark */
+typedef struct trace_event {
+	char name[23];
+	char ph; // 'B' begin, 'E' end
+	double ts; // microseconds since trace_start
+}trace_event;
+
+#if TRACE_ENABLE
+#define TRACE_START() trace_start()
+#define TRACE_BEGIN(name) trace_mark(name, 'B')
+#define TRACE_END(name) trace_mark(name, 'E')
+#define TRACE_WRITE(taskid, numtasks) trace_write(taskid, numtasks)
+#else
+#define TRACE_START()
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_WRITE(taskid, numtasks)
+#endif
+
 
 /* Declare all function prototype                                             */
 int PictureNew(picture *m, int x, int y);
-void read_pict(picture *pict, int *r, int *c);
+void PoolInit(picture_pool *pool);
+int PicturePoolNew(picture_pool *pool, picture *m, int x, int y, int zero);
+void PictureRelease(picture_pool *pool, picture *m);
+void PoolFree(picture_pool *pool);
+void PoolStats(picture_pool *pool, int taskid);
+extern numa_place numa;
+void numa_pin(int threads);
+void first_touch(picture *m);
+void numa_stats(picture_pool *pool, int taskid);
+void band_split(int height, int numtasks, int halo, int taskid, band *b);
+void filter_shared(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks);
+int shared_init(int taskid, int numtasks);
+int shared_views(picture *pict, picture *newpict, int taskid, int numtasks);
+void shared_free(void);
+void filter_bands(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks);
+void run_job(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks);
+void filter_tiles(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks);
+void autotune(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks);
+void tile_send(picture *pict, int *hdr, int w, MPI_Request *req);
+void serve_jobs(picture_pool *pool, filter_job *job, picture *pict, picture *newpict, int numtasks);
+int pipe_readline(HANDLE pipe, char *line, int max);
+int serve_filter(const char *p, filter_job *job, char *reason);
+extern const char *bench_names[];
+int bench_run(picture_pool *pool, filter_job *job, int taskid, int numtasks,
+	double threshold, int rebase);
+void bench_once(picture_pool *pool, bench_data *bd, int p, int taskid, int numtasks);
+int bench_check(picture_pool *pool, filter_job *job, int taskid, int numtasks);
+void bench_job(filter_job *job);
+void trace_start(void);
+void trace_mark(const char *name, char ph);
+void trace_write(int taskid, int numtasks);
+extern const char *op_names[];
+int op_by_name(const char *name);
+int op_halo(filter_job *job);
+int op_halo_x(filter_job *job);
+int op_radius_ok(filter_job *job);
+void apply_op(filter_job *job, picture *pict, int r, int c, picture *new_pict);
+void median_filter(picture *pict, int r, int c, int radius, int maxval, picture *new_pict);
+void median_hist(picture *pict, int r, int c, int radius, picture *new_pict);
+void median_select(picture *pict, int r, int c, int radius, picture *new_pict);
+void integral_image(picture *pict, int r, int c, long long *sat, int threads);
+void box_filter(picture *pict, int r, int c, int radius, picture *new_pict, int threads);
+void morph_rows(const int *a, const int *b, int *out, int c, int dilate);
+void morph_filter(picture *pict, int r, int c, int rx, int ry, int dilate, picture *new_pict);
+void morph_open_close(picture *pict, int r, int c, int rx, int ry, int close, picture *new_pict);
+void filter_pyramid(picture_pool *pool, filter_job *job, picture *pict, picture *newpict);
+FILE *tiled_create(const char *fname, int width, int height, int tile);
+void tiled_put_strip(FILE *out, picture *strip, int rows, int width, int tile);
+int tiled_convert(const char *pgm, const char *fname, int tile);
+void tiled_write(const char *fname, picture *pict, int r, int c, int tile);
+char *tiled_view(HANDLE map, long long offset, long long len, int write, void **base);
+int tiled_access(const char *fname, picture *pict, int px, int py, int x, int y, int w, int h,
+	int write, tiled_header *info);
+int is_tiled(const char *fname);
+int read_input(filter_job *job, picture *pict, int *roi, int *at);
+void write_output(filter_job *job, picture *newpict, int *roi, int *at);
+void pyramid_down(picture *src, int r, int c, picture *dst);
+int fixed_kernel(double filter[][FILTER_SIZE], int maxval, fixed_filter *fk);
+void image_filter_fixed(picture *pict, int r, int c, fixed_filter *fk, picture *new_pict);
+void validate_fixed(picture_pool *pool, filter_job *job, picture *pict);
+int read_pict(const char *fname, picture *pict, int *r, int *c, int *maxval);
 void image_filter(picture *pict, int r, int c, double filter[][FILTER_SIZE], picture *new_pict);
-void write_pict(picture *pict, int r, int c);
+void write_pict(const char *fname, picture *pict, int r, int c, int maxval);
+FILE *write_begin(const char *fname, int r, int c, int maxval);
+void write_rows(FILE *out, picture *pict, int first, int n, int c);
+void write_end(FILE *out);
 
 
 /* Begin the Main Function                                                    */
+/* usage : matrix            filter original.pgm into new.pgm once            */
+/*         matrix -serve     stay resident, take jobs from PIPE_NAME          */
+/*         matrix -median R  median of (2R+1)x(2R+1) instead of the filter    */
+/*         matrix -box R     mean of (2R+1)x(2R+1) instead of the filter      */
+/*         matrix -erode RX [RY]  min of (2RX+1)x(2RY+1) rectangle, also      */
+/*                           -dilate (max), -open and -close                  */
+/*         matrix -threads N threads per task                                 */
+/*         matrix -pin       pin threads to cores, buffers on their NUMA node */
+/*         matrix -dynamic T tiles of T rows handed out by root as workers    */
+/*                           finish, -inflight K tiles queued per worker      */
+/*         matrix -local     root filters alone (with -threads)               */
+/*         matrix -shm       bands in MPI shared memory, tasks on one host    */
+/*         matrix -pyramid N filter N levels of a Gaussian pyramid at root,   */
+/*                           level k to new_k.pgm                             */
+/*         matrix -stream    root writes every band as soon as it arrives     */
+/*         matrix -totiled F convert original.pgm to tiled picture file F     */
+/*         matrix -in F -out G  other input and output, tiled if .imt         */
+/*         matrix -roi X Y W H  filter only this region of a tiled input, G   */
+/*                           gets the region (PGM) or has it updated (.imt)   */
+/*         matrix -auto      time the modes once per size, then use fastest   */
+/*         matrix -fixed     filter in integers even if not exact, -double    */
+/*                           never in integers, -validate report difference   */
+/*         matrix -bench     time every path against bench_baseline.txt, fail */
+/*                           if slower by -threshold P percent, -rebase       */
+/*                           records a new baseline for this host, the first  */
+/*                           run of a host records it without comparing       */
 int main(int argc, char *argv[])
 {
 	double flt[FILTER_SIZE][FILTER_SIZE] = { { -1.25	, 0		,-1.25 },
 											 { 0		, 10	, 0 },
 											 { -1.25	, 0		, -1.25 } };
-	const int aveheight = IM_SIZE/4;
 	
 	int	numtasks,              /* number of tasks in partition */
 		taskid,                /* a task identifier */
-		i, j, rc;				   /* misc */
+		serve = 0,			   /* 1 = run as persistent filter service */
+		validate = 0,		   /* 1 = compare integer and double filter */
+		bench = 0,			   /* 1 = run the regression suite */
+		rebase = 0,			   /* 1 = record a new bench baseline */
+		views = 0,			   /* 1 = root pictures are in the shared window */
+		i, k, rc = 1;		   /* misc */
+	char *end;				   /* end of a number argument */
+	double threshold = BENCH_THRESHOLD; /* % slower that fails bench */
+	int roi[4] = { 0 },		   /* region of a tiled input, x y w h */
+		at[4];				   /* region read with its halo, see read_input */
+	char totiled[JOB_PATH] = "";  /* tiled file to convert the input to */
+	picture pict, newpict;	   /* main matrix to store picture, root only */
+	picture_pool pool;		   /* buffers reused across frames */
+	filter_job job;			   /* current job, same on every rank */
 
 	dwStart = GetTickCount();
 	/* Initializing MPI environment */
-	MPI_Status status;
 	MPI_Init(&argc, &argv);
 	MPI_Comm_rank(MPI_COMM_WORLD, &taskid);
 	MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
@@ -58,274 +343,3044 @@ int main(int argc, char *argv[])
 		MPI_Abort(MPI_COMM_WORLD, rc);
 		exit(1);
 	}
+	TRACE_START();
+
+	/* default job, filter original.pgm into new.pgm */
+	memset(&job, 0, sizeof(filter_job));
+	memcpy(job.flt, flt, sizeof(flt));
+	job.op = OP_CONV;
+	job.maxval = 255;
+	job.threads = 1;
+	job.inflight = 2;
+	strcpy(job.in, "original.pgm");
+	strcpy(job.out, "new.pgm");
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-serve") == 0)
+			serve = 1;
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+			job.threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-dynamic") == 0 && i + 1 < argc)
+		{
+			job.mode = MODE_TILES;
+			job.tile = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-local") == 0)
+			job.mode = MODE_LOCAL;
+		else if (strcmp(argv[i], "-shm") == 0)
+			job.mode = MODE_SHARED;
+		else if (strcmp(argv[i], "-stream") == 0)
+			job.stream = 1;
+		else if (strcmp(argv[i], "-pin") == 0)
+			job.pin = 1;
+		else if (strcmp(argv[i], "-totiled") == 0 && i + 1 < argc)
+			strncpy(totiled, argv[++i], JOB_PATH - 1);
+		else if (strcmp(argv[i], "-in") == 0 && i + 1 < argc)
+			strncpy(job.in, argv[++i], JOB_PATH - 1);
+		else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+			strncpy(job.out, argv[++i], JOB_PATH - 1);
+		else if (strcmp(argv[i], "-roi") == 0 && i + 4 < argc)
+			for (k = 0; k < 4; k++)
+				roi[k] = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-pyramid") == 0 && i + 1 < argc)
+			job.levels = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-auto") == 0)
+			job.autotune = 1;
+		else if (strcmp(argv[i], "-fixed") == 0)
+			job.fixed = FIX_ALWAYS;
+		else if (strcmp(argv[i], "-double") == 0)
+			job.fixed = FIX_NEVER;
+		else if (strcmp(argv[i], "-validate") == 0)
+			validate = 1;
+		else if (strcmp(argv[i], "-bench") == 0)
+			bench = 1;
+		else if (strcmp(argv[i], "-rebase") == 0)
+			rebase = 1;
+		else if (strcmp(argv[i], "-threshold") == 0 && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else if (strcmp(argv[i], "-inflight") == 0 && i + 1 < argc)
+			job.inflight = atoi(argv[++i]);
+		else if (argv[i][0] == '-' && op_by_name(argv[i] + 1) >= 0 && i + 1 < argc)
+		{
+			job.op = op_by_name(argv[i] + 1);
+			job.radius = job.radius_y = atoi(argv[++i]);
+			/* morphology takes an optional half height */
+			if (job.op >= OP_ERODE && i + 1 < argc && strtol(argv[i + 1], &end, 10) >= 0 &&
+				end != argv[i + 1] && *end == '\0')
+				job.radius_y = atoi(argv[++i]);
+		}
+	}
+	PoolInit(&pool);
+
+	if (bench)
+	{
+		/* exit code 1 if the suite failed */
+		rc = bench_run(&pool, &job, taskid, numtasks, threshold, rebase) ? 0 : 1;
+		shared_free();
+		PoolFree(&pool);
+		MPI_Finalize();
+		return(rc);
+	}
+
+	/* place the threads before the main pictures are first touched */
+	if (job.pin)
+	{
+#ifdef _OPENMP
+		omp_set_num_threads(job.threads < 1 ? 1 : job.threads);
+#endif
+		numa_pin(job.threads);
+		pool.touch = 1;
+	}
+
+	/* -shm, and -auto that may choose it, read and write the pictures in */
+	/* the window of filter_shared instead of copying them there          */
+	if (job.mode == MODE_SHARED || job.autotune)
+		views = shared_views(&pict, &newpict, taskid, numtasks);
+
+	if (taskid == 0)
+	{
+		/* create main matrix to store picture, kept for every job */
+		if (!views && PicturePoolNew(&pool, &newpict, IM_SIZE, IM_SIZE, 0) != 1)
+			printf("creating main new picture matrix failed\n");
+		if (!views && PicturePoolNew(&pool, &pict, IM_SIZE, IM_SIZE, 0) != 1)
+			printf("creating main ori picture matrix failed\n"); 
+
+		if (serve)
+		{
+			serve_jobs(&pool, &job, &pict, &newpict, numtasks);
+		}
+		else if (totiled[0])
+		{
+			/* convert only, nothing to do for the workers */
+			tiled_convert(job.in, totiled, TILED_SIZE);
+			job.quit = 1;
+			MPI_Bcast(&job, sizeof(filter_job), MPI_BYTE, 0, MPI_COMM_WORLD);
+		}
+		else
+		{
+			/* read picture file, or the region of a tiled one */
+			if (read_input(&job, &pict, roi, at) != 1)
+				MPI_Abort(MPI_COMM_WORLD, rc);
+			if (!op_radius_ok(&job))
+			{
+				printf("Radius %d %d out of range for %d x %d picture\n", job.radius, job.radius_y,
+					job.width, job.height);
+				MPI_Abort(MPI_COMM_WORLD, rc);
+			}
+			if (is_tiled(job.in) || is_tiled(job.out))
+				job.stream = 0;
+			if (validate)
+				validate_fixed(&pool, &job, &pict);
+
+			/* tell every worker what to do, then filter own band */
+			MPI_Bcast(&job, sizeof(filter_job), MPI_BYTE, 0, MPI_COMM_WORLD);
+			run_job(&pool, &job, &pict, &newpict, taskid, numtasks);
+
+			/* print the image, unless run_job did */
+			if (!job.stream)
+				write_output(&job, &newpict, roi, at);
+			printf_s("time taken, %d milliseconds\n", GetTickCount() - dwStart);
+		}
+
+		/* Dont forget to release memory used :) */
+		if (!views)
+		{
+			PictureRelease(&pool, &pict);
+			PictureRelease(&pool, &newpict);
+		}
+		PoolStats(&pool, taskid);
+	}
+
+	else
+	{
+		/* workers take jobs until root says quit, one job if not serving */
+		do
+		{
+			MPI_Bcast(&job, sizeof(filter_job), MPI_BYTE, 0, MPI_COMM_WORLD);
+			if (job.quit)
+				break;
+			run_job(&pool, &job, NULL, NULL, taskid, numtasks);
+		} while (serve);
+		if (numa.pinned)
+			PoolStats(&pool, taskid);
+	}
+
+	TRACE_WRITE(taskid, numtasks);
+	shared_free();
+	PoolFree(&pool);
+	MPI_Finalize();
+
+
+	return(0);
+	/* End Main Function                                                          */
+}
+
+#if TRACE_ENABLE
+/* Begin trace functions                                                      */
+/******************************************************************************/
+/* Purpose : Record begin/end of the steps of every task and write them all   */
+/*           to TRACE_FILE as Chrome trace events (chrome://tracing), one     */
+/*           process row per task. Only built with TRACE_ENABLE.              */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* trace_buf[]            trace_event  events of this task                   */
+/* trace_n                int      # of events recorded                       */
+/* trace_t0               double   MPI_Wtime after the start barrier          */
+/* all                    trace_event *  events of every task (root only)     */
+/******************************************************************************/
+/* Source Code:                                                               */
+trace_event trace_buf[TRACE_MAX];
+int trace_n = 0;
+double trace_t0 = 0;
+
+void trace_start(void)
+{
+	MPI_Barrier(MPI_COMM_WORLD);
+	trace_t0 = MPI_Wtime();
+	trace_n = 0;
+}
+
+void trace_mark(const char *name, char ph)
+{
+	if (trace_n == TRACE_MAX)
+		return;
+	strncpy(trace_buf[trace_n].name, name, sizeof(trace_buf[trace_n].name) - 1);
+	trace_buf[trace_n].name[sizeof(trace_buf[trace_n].name) - 1] = '\0';
+	trace_buf[trace_n].ph = ph;
+	trace_buf[trace_n].ts = (MPI_Wtime() - trace_t0) * 1e6;
+	trace_n++;
+}
+
+void trace_write(int taskid, int numtasks)
+{
+	trace_event *all = NULL;
+	int *counts = NULL, *displs = NULL;
+	int i, k, total = 0;
+	FILE *out;
+
+	/* collect every task's events at root */
+	if (taskid == 0)
+	{
+		counts = (int*)malloc(2 * numtasks * sizeof(int));
+		displs = counts + numtasks;
+	}
+	k = trace_n * sizeof(trace_event);
+	MPI_Gather(&k, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if (taskid == 0)
+	{
+		for (i = 0; i < numtasks; i++)
+		{
+			displs[i] = total;
+			total += counts[i];
+		}
+		all = (trace_event*)malloc(total + 1);
+	}
+	MPI_Gatherv(trace_buf, k, MPI_BYTE, all, counts, displs, MPI_BYTE, 0, MPI_COMM_WORLD);
+
+	if (taskid == 0)
+	{
+		out = fopen(TRACE_FILE, "w");
+		if (out == NULL)
+			printf("Error writing %s\n", TRACE_FILE);
+		else
+		{
+			fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+			for (i = 0; i < numtasks; i++)
+				fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"task %d\"}},\n", i, i);
+			for (i = 0; i < numtasks; i++)
+				for (k = displs[i] / (int)sizeof(trace_event); k < (displs[i] + counts[i]) / (int)sizeof(trace_event); k++)
+					fprintf(out, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.1f,\"pid\":%d,\"tid\":0},\n",
+						all[k].name, all[k].ph, all[k].ts, i);
+			fprintf(out, "{\"name\":\"end\",\"ph\":\"i\",\"ts\":%.1f,\"pid\":0,\"tid\":0,\"s\":\"g\"}\n]}\n",
+				(MPI_Wtime() - trace_t0) * 1e6);
+			fclose(out);
+			printf("trace of %d tasks written to %s\n", numtasks, TRACE_FILE);
+		}
+		free(all);
+		free(counts);
+	}
+	return;
+	/* End trace functions                                                        */
+}
+#endif
+
+/* Begin run_job function                                                     */
+/******************************************************************************/
+/* Purpose : Filter one job on all tasks in the mode of the job, autotune     */
+/*           chooses the mode first if asked to. A stream job is written to   */
+/*           job->out here, by filter_bands while the bands arrive.           */
+/******************************************************************************/
+/* Source Code:                                                               */
+void run_job(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks)
+{
+	filter_job tuned;
+
+	if (job->autotune)
+	{
+		tuned = *job;
+		tuned.autotune = 0;
+		autotune(pool, &tuned, pict, newpict, taskid, numtasks);
+		job = &tuned;
+	}
+#ifdef _OPENMP
+	omp_set_num_threads(job->threads < 1 ? 1 : job->threads);
+#endif
+	if (job->pin)
+		numa_pin(job->threads);
+	pool->touch = job->pin;
+
+	if (job->levels > 1)
+	{
+		if (taskid == 0)
+			filter_pyramid(pool, job, pict, newpict);
+	}
+	else if (job->mode == MODE_TILES && job->tile > 0)
+		filter_tiles(pool, job, pict, newpict, taskid, numtasks);
+	else if (job->mode == MODE_LOCAL)
+	{
+		if (taskid == 0)
+			apply_op(job, pict, job->height, job->width, newpict);
+	}
+	else if (job->mode == MODE_SHARED)
+		filter_shared(pool, job, pict, newpict, taskid, numtasks);
+	else
+	{
+		filter_bands(pool, job, pict, newpict, taskid, numtasks);
+		return;
+	}
+	if (job->stream && taskid == 0)
+		write_pict(job->out, newpict, job->height, job->width, job->maxval);
+	return;
+	/* End run_job function                                                       */
+}
+
+/* Begin autotune function                                                    */
+/******************************************************************************/
+/* Purpose : Pick the fastest way to run the job on this host. The first job  */
+/*           of a size, operation, window and task count times every          */
+/*           candidate (root alone, root with all cores, one band per task,   */
+/*           dynamic tiles of 16/32/64 rows, bands in shared memory) and      */
+/*           appends the best to CALIB_FILE, later jobs only look it up. Sets */
+/*           mode, threads and tile of job.                                   */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* cand[][3]              int      mode, threads, tile of every candidate     */
+/* best[5]                int      found, mode, threads, tile, candidate      */
+/* host[]                 char     processor name of root                     */
+/* t, tbest               double   seconds of a candidate, of the best one    */
+/******************************************************************************/
+/* Source Code:                                                               */
+void autotune(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks)
+{
+	int cand[7][3] = { { MODE_LOCAL, 1, 0 }, { MODE_LOCAL, 1, 0 }, { MODE_BANDS, 1, 0 },
+					   { MODE_TILES, 1, 16 }, { MODE_TILES, 1, 32 }, { MODE_TILES, 1, 64 },
+					   { MODE_SHARED, 1, 0 } };
+	char host[MPI_MAX_PROCESSOR_NAME];
+	int best[5] = { 0 };
+	int i, k, len, ksize, ksize_y;
+	double t, t0, tbest = 0;
+	filter_job trial;
+	FILE *f;
+
+	MPI_Get_processor_name(host, &len);
+	ksize = job->op == OP_CONV ? FILTER_SIZE : 2 * job->radius + 1;
+	ksize_y = job->op == OP_CONV ? FILTER_SIZE : 2 * job->radius_y + 1;
+#ifdef _OPENMP
+	cand[1][1] = omp_get_num_procs();
+#endif
+	/* cores of root, every task must try the same candidates */
+	MPI_Bcast(&cand[1][1], 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	/* look for this job in the calibration table, last entry wins */
+	if (taskid == 0 && (f = fopen(CALIB_FILE, "r")) != NULL)
+	{
+		char line[300], name[MPI_MAX_PROCESSOR_NAME];
+		int key[6], cfg[3];
+
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "%255s %d %d %d %d %d %d %d %d %d", name, &key[0], &key[1], &key[2],
+				&key[3], &key[4], &key[5], &cfg[0], &cfg[1], &cfg[2]) == 10 && strcmp(name, host) == 0 &&
+				key[0] == job->height && key[1] == job->width && key[2] == job->op &&
+				key[3] == ksize && key[4] == ksize_y && key[5] == numtasks)
+			{
+				best[0] = 1;
+				memcpy(best + 1, cfg, sizeof(cfg));
+			}
+		fclose(f);
+	}
+	MPI_Bcast(best, 5, MPI_INT, 0, MPI_COMM_WORLD);
+
+	if (!best[0])
+	{
+		/* time every candidate, first run is a warm up */
+		for (i = 0; i < 7; i++)
+		{
+			if (i == 1 && cand[1][1] < 2)
+				continue;
+			trial = *job;
+			trial.stream = 0;
+			trial.mode = cand[i][0];
+			trial.threads = cand[i][1];
+			trial.tile = cand[i][2];
+			for (k = 0; k <= TUNE_TRIALS; k++)
+			{
+				MPI_Barrier(MPI_COMM_WORLD);
+				t0 = MPI_Wtime();
+				run_job(pool, &trial, pict, newpict, taskid, numtasks);
+				t = MPI_Wtime() - t0;
+				if (taskid == 0 && k > 0 && (best[0] == 0 || t < tbest))
+				{
+					best[0] = 1;
+					best[4] = i;
+					tbest = t;
+				}
+			}
+		}
+		if (taskid == 0)
+		{
+			memcpy(best + 1, cand[best[4]], sizeof(cand[0]));
+			f = fopen(CALIB_FILE, "a");
+			if (f == NULL)
+				printf("Error writing %s\n", CALIB_FILE);
+			else
+			{
+				fprintf(f, "%s %d %d %d %d %d %d %d %d %d %.3f\n", host, job->height, job->width, job->op,
+					ksize, ksize_y, numtasks, best[1], best[2], best[3], tbest * 1000);
+				fclose(f);
+			}
+		}
+		MPI_Bcast(best, 5, MPI_INT, 0, MPI_COMM_WORLD);
+	}
+
+	job->mode = best[1];
+	job->threads = best[2];
+	job->tile = best[3];
+	if (taskid == 0)
+		printf("autotune %dx%d on %s: mode %d, %d threads, tile %d\n", job->width, job->height, host,
+			job->mode, job->threads, job->tile);
+	return;
+	/* End autotune function                                                      */
+}
+
+/* Begin filter_tiles function                                                */
+/******************************************************************************/
+/* Purpose : Dynamic scheduling, root cuts the picture in tiles of job->tile  */
+/*           rows (full width) and hands the next tile with its halo to       */
+/*           whichever worker returns a result. Every worker has up to        */
+/*           job->inflight tiles queued so it never waits for the next one,   */
+/*           and receives the next tile while filtering the current one.      */
+/*           A tile is one message, TILE_HDR ints of header then the rows,    */
+/*           sent without copying through an MPI_Type_create_hindexed type.   */
+/*           Tiles use the same halo and edges as bands, so the result is     */
+/*           the same as filter_bands. Root only schedules and collects.      */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* ntiles                 int      # of tiles                                 */
+/* next                   int      next tile to hand out                      */
+/* hdr[][TILE_HDR]        int      first, rows, top, bottom of every tile     */
+/* req[]                  MPI_Request  pending sends of root                  */
+/* stopped[]              int      1 = worker got its stop message            */
+/* buf[2]                 picture  tile being filtered and tile being read    */
+/* tile                   picture  rows of buf after the header               */
+/* rreq[2]                MPI_Request  receive of every buffer                */
+/******************************************************************************/
+/* Source Code:                                                               */
+void filter_tiles(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks)
+{
+	const int halo = op_halo(job);
+	const int ntiles = (job->height + job->tile - 1) / job->tile;
+	const int inflight = job->inflight < 1 ? 1 : job->inflight;
+	MPI_Status status;
+	int i, k, w;
+
+	if (taskid == 0)
+	{
+		int(*hdr)[TILE_HDR] = (int(*)[TILE_HDR])calloc(ntiles + numtasks, sizeof(*hdr));
+		MPI_Request *req = (MPI_Request*)malloc((ntiles + numtasks) * sizeof(MPI_Request));
+		int *stopped = (int*)calloc(numtasks, sizeof(int));
+		int next = 0, nreq = 0, done = 0, res[4];
+
+		for (i = 0; i < ntiles; i++)
+		{
+			hdr[i][0] = i * job->tile;
+			hdr[i][1] = job->height - hdr[i][0] < job->tile ? job->height - hdr[i][0] : job->tile;
+			hdr[i][2] = hdr[i][0] < halo ? hdr[i][0] : halo;
+			k = job->height - hdr[i][0] - hdr[i][1];
+			hdr[i][3] = k < halo ? k : halo;
+		}
+		/* hdr[ntiles + w] stays zero, the stop message of worker w */
+		/* fill the queue of every worker */
+		for (k = 0; k < inflight; k++)
+			for (w = 1; w < numtasks; w++)
+			{
+				if (next < ntiles)
+				{
+					tile_send(pict, hdr[next], w, req + nreq++);
+					next++;
+				}
+				else if (k == 0)
+				{
+					/* more workers than tiles */
+					MPI_Isend(hdr[ntiles + w], TILE_HDR, MPI_INT, w, TAG_TILE, MPI_COMM_WORLD, req + nreq++);
+					stopped[w] = 1;
+				}
+			}
+
+		/* collect results, give the sender the next tile or stop it */
+		while (done < ntiles)
+		{
+			TRACE_BEGIN("MPI_Recv");
+			MPI_Recv(res, 4, MPI_INT, MPI_ANY_SOURCE, TAG_DONE, MPI_COMM_WORLD, &status);
+			w = status.MPI_SOURCE;
+			MPI_Recv(newpict->data + res[0] * newpict->col, res[1] * newpict->col, MPI_INT,
+				w, TAG_DONE_DATA, MPI_COMM_WORLD, &status);
+			TRACE_END("MPI_Recv");
+			done++;
+
+			if (next < ntiles)
+			{
+				tile_send(pict, hdr[next], w, req + nreq++);
+				next++;
+			}
+			else if (!stopped[w])
+			{
+				/* queue is empty, stop the worker behind its queued tiles */
+				MPI_Isend(hdr[ntiles + w], TILE_HDR, MPI_INT, w, TAG_TILE, MPI_COMM_WORLD, req + nreq++);
+				stopped[w] = 1;
+			}
+		}
+		MPI_Waitall(nreq, req, MPI_STATUSES_IGNORE);
+		free(stopped);
+		free(req);
+		free(hdr);
+	}
+	else
+	{
+		picture buf[2];
+		picture tile;
+		picture local_newpict;
+		MPI_Request rreq[2];
+		int *h, res[4];
+		int cur = 0, r;
+
+		/* one spare row for the header, keeps the rows aligned */
+		for (k = 0; k < 2; k++)
+			if (PicturePoolNew(pool, &buf[k], job->tile + 2 * halo + 1, IM_SIZE, 0) != 1)
+				printf("creating tile picture matrix at workder %d failed\n", taskid);
+		if (PicturePoolNew(pool, &local_newpict, job->tile + 2 * halo, IM_SIZE, 0) != 1)
+			printf("creating tile new picture matrix at workder %d failed\n", taskid);
+
+		MPI_Irecv(buf[cur].data, buf[cur].row * buf[cur].col, MPI_INT, 0, TAG_TILE, MPI_COMM_WORLD, &rreq[cur]);
+		while (1)
+		{
+			TRACE_BEGIN("MPI_Recv");
+			MPI_Wait(&rreq[cur], &status);
+			TRACE_END("MPI_Recv");
+			h = buf[cur].data;
+			if (h[1] == 0)
+				break;
+
+			/* read the next tile while this one is filtered */
+			MPI_Irecv(buf[1 - cur].data, buf[1 - cur].row * buf[1 - cur].col, MPI_INT, 0, TAG_TILE,
+				MPI_COMM_WORLD, &rreq[1 - cur]);
+
+			r = h[2] + h[1] + h[3];
+			tile.row = r;
+			tile.col = buf[cur].col;
+			tile.data = buf[cur].data + TILE_HDR;
+			TRACE_BEGIN(op_names[job->op]);
+			apply_op(job, &tile, r, job->width, &local_newpict);
+			TRACE_END(op_names[job->op]);
+
+			TRACE_BEGIN("MPI_Send");
+			res[0] = h[0];
+			res[1] = h[1];
+			res[2] = res[3] = 0;
+			MPI_Send(res, 4, MPI_INT, 0, TAG_DONE, MPI_COMM_WORLD);
+			MPI_Send(local_newpict.data + h[2] * local_newpict.col, h[1] * local_newpict.col,
+				MPI_INT, 0, TAG_DONE_DATA, MPI_COMM_WORLD);
+			TRACE_END("MPI_Send");
+			cur = 1 - cur;
+		}
+
+		PictureRelease(pool, &buf[0]);
+		PictureRelease(pool, &buf[1]);
+		PictureRelease(pool, &local_newpict);
+	}
+	return;
+	/* End filter_tiles function                                                  */
+}
+
+/* send tile hdr (first, rows, top, bottom) and its rows with halo to worker w */
+void tile_send(picture *pict, int *hdr, int w, MPI_Request *req)
+{
+	MPI_Datatype type;
+	MPI_Aint disp[2];
+	int len[2];
+
+	TRACE_BEGIN("MPI_Send");
+	MPI_Get_address(hdr, &disp[0]);
+	MPI_Get_address(pict->data + (hdr[0] - hdr[2]) * pict->col, &disp[1]);
+	len[0] = TILE_HDR;
+	len[1] = (hdr[2] + hdr[1] + hdr[3]) * pict->col;
+	MPI_Type_create_hindexed(2, len, disp, MPI_INT, &type);
+	MPI_Type_commit(&type);
+	MPI_Isend(MPI_BOTTOM, 1, type, w, TAG_TILE, MPI_COMM_WORLD, req);
+	MPI_Type_free(&type);
+	TRACE_END("MPI_Send");
+	return;
+}
+
+/* Begin filter_bands function                                                */
+/******************************************************************************/
+/* Purpose : Split the job into one band of rows per task, send every band    */
+/*           with the halo rows its filter needs above and below (N-1 and N+1 */
+/*           for the 3x3 filter), filter it and gather the result back.       */
+/*           Called by all tasks, pict and newpict are only used at root.     */
+/*           A stream job has no gather: root posts a receive per band before */
+/*           filtering its own and writes job->out band by band in row order  */
+/*           as they complete, while the other tasks still filter.            */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* job                    filter_job *  picture size and filter               */
+/* pict                   picture *     whole picture (root only)             */
+/* newpict                picture *     whole filtered picture (root only)    */
+/* b                      band     rows owned by this task and its halo       */
+/* counts[], displs[]     int *    scatter/gather layout (root only)          */
+/* local_pict             picture  band with halo                             */
+/* local_newpict          picture  filtered band with halo                    */
+/* req[]                  MPI_Request  receive of every band (stream, root)   */
+/* done[]                 int      band k arrived (stream, root)              */
+/* next                   int      next band to write (stream, root)          */
+/******************************************************************************/
+/* Source Code:                                                               */
+void filter_bands(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks)
+{
+	MPI_Status status;
+	MPI_Request *req = NULL;
+	picture local_pict;
+	picture local_newpict;
+	int *counts = NULL, *displs = NULL, *done = NULL;
+	int i, r, next, halo = op_halo(job);
+	band b, bk;
+	FILE *out;
+
+	/* create local matrix to worked by this worker */
+	band_split(job->height, numtasks, halo, taskid, &b);
+	r = b.top + b.rows + b.bottom;
+	if (PicturePoolNew(pool, &local_newpict, r, IM_SIZE, 0) != 1)
+		printf("creating local new picture matrix at workder %d failed\n", taskid);
+	if (PicturePoolNew(pool, &local_pict, r, IM_SIZE, 0) != 1)
+		printf("creating local ori picture matrix at workder %d failed\n", taskid);
+
+	if (taskid == 0)
+	{
+		counts = (int*)malloc(2 * numtasks * sizeof(int));
+		displs = counts + numtasks;
+		for (i = 0; i < numtasks; i++)
+		{
+			band_split(job->height, numtasks, halo, i, &bk);
+			counts[i] = bk.rows * pict->col;
+			displs[i] = bk.first * pict->col;
+		}
+	}
+
+	/* scatter file for other worker */
+	TRACE_BEGIN("MPI_Scatter");
+	MPI_Scatterv(pict ? pict->data : NULL, counts, displs, MPI_INT,
+		local_pict.data + b.top * local_pict.col, b.rows * local_pict.col, MPI_INT, 0, MPI_COMM_WORLD);
+	TRACE_END("MPI_Scatter");
+
+	if (taskid == 0)
+	{
+		/* send halo above & below to other worker */
+		for (i = 1; i < numtasks; i++)
+		{
+			band_split(job->height, numtasks, halo, i, &bk);
+			TRACE_BEGIN("MPI_Send");
+			if (bk.top)
+				MPI_Send(pict->data + (bk.first - bk.top) * pict->col, bk.top * pict->col,
+					MPI_INT, i, 0, MPI_COMM_WORLD);
+			if (bk.bottom)
+				MPI_Send(pict->data + (bk.first + bk.rows) * pict->col, bk.bottom * pict->col,
+					MPI_INT, i, 0, MPI_COMM_WORLD);
+			TRACE_END("MPI_Send");
+		}
+
+		/* halo below for worker 0 */
+		memcpy(local_pict.data + b.rows * local_pict.col, pict->data + b.rows * pict->col,
+			b.bottom * pict->col * sizeof(int));
+	}
+	else
+	{
+		/* receive halo above and below */
+		TRACE_BEGIN("MPI_Recv");
+		if (b.top)
+			MPI_Recv(local_pict.data, b.top * local_pict.col, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
+		if (b.bottom)
+			MPI_Recv(local_pict.data + (b.top + b.rows) * local_pict.col, b.bottom * local_pict.col,
+				MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
+		TRACE_END("MPI_Recv");
+	}
+
+	/* stream, bands go straight into newpict as the workers finish */
+	if (job->stream && taskid == 0)
+	{
+		req = (MPI_Request*)malloc(numtasks * sizeof(MPI_Request));
+		done = (int*)calloc(numtasks, sizeof(int));
+		req[0] = MPI_REQUEST_NULL;
+		for (i = 1; i < numtasks; i++)
+		{
+			band_split(job->height, numtasks, halo, i, &bk);
+			MPI_Irecv(newpict->data + bk.first * newpict->col, bk.rows * newpict->col, MPI_INT,
+				i, TAG_BAND, MPI_COMM_WORLD, &req[i]);
+		}
+	}
+
+	/* do local filtering for image */
+	TRACE_BEGIN(op_names[job->op]);
+	if (b.rows > 0)
+		apply_op(job, &local_pict, r, job->width, &local_newpict);
+	TRACE_END(op_names[job->op]);
+
+	if (!job->stream)
+	{
+		/* gather back result to root */
+		TRACE_BEGIN("MPI_Gather");
+		MPI_Gatherv(local_newpict.data + b.top * local_newpict.col, b.rows * local_newpict.col, MPI_INT,
+			newpict ? newpict->data : NULL, counts, displs, MPI_INT, 0, MPI_COMM_WORLD);
+		TRACE_END("MPI_Gather");
+	}
+	else if (taskid != 0)
+	{
+		TRACE_BEGIN("MPI_Send");
+		MPI_Send(local_newpict.data + b.top * local_newpict.col, b.rows * local_newpict.col, MPI_INT,
+			0, TAG_BAND, MPI_COMM_WORLD);
+		TRACE_END("MPI_Send");
+	}
+	else
+	{
+		/* own band first, then every band whose bands above are written */
+		memcpy(newpict->data, local_newpict.data + b.top * local_newpict.col,
+			b.rows * newpict->col * sizeof(int));
+		done[0] = 1;
+		out = write_begin(job->out, job->height, job->width, job->maxval);
+		for (next = 0; next < numtasks; )
+		{
+			if (!done[next])
+			{
+				TRACE_BEGIN("MPI_Waitany");
+				MPI_Waitany(numtasks, req, &i, &status);
+				TRACE_END("MPI_Waitany");
+				done[i] = 1;
+				continue;
+			}
+			band_split(job->height, numtasks, halo, next++, &bk);
+			TRACE_BEGIN("write_rows");
+			if (out != NULL)
+				write_rows(out, newpict, bk.first, bk.rows, job->width);
+			TRACE_END("write_rows");
+		}
+		if (out != NULL)
+			write_end(out);
+		free(req);
+		free(done);
+	}
+
+	/* Dont forget to release memory used */
+	free(counts);
+	PictureRelease(pool, &local_pict);
+	PictureRelease(pool, &local_newpict);
+	return;
+	/* End filter_bands function                                                  */
+}
+
+/* Begin filter_shared function                                               */
+/******************************************************************************/
+/* Purpose : filter_bands without MPI copies, for tasks on one host. The      */
+/*           picture is in a window of MPI_Win_allocate_shared (root reads it */
+/*           there, see shared_views, or copies it in), every task filters    */
+/*           its band reading the window in place (halo rows included) and    */
+/*           writes its own rows to the output half of the window, which is   */
+/*           root's newpict, a barrier separates the steps. The band is       */
+/*           filtered into a pooled buffer first, the edge rows apply_op      */
+/*           copies belong to the neighbours. Falls back to filter_bands if   */
+/*           the tasks are not all on one host.                               */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* shm                    shared_pict  window, kept for the next jobs         */
+/* view                   picture  band with halo, inside the window          */
+/* local_newpict          picture  filtered band with halo                    */
+/******************************************************************************/
+/* Source Code:                                                               */
+shared_pict shm = { MPI_COMM_NULL, MPI_WIN_NULL, NULL, 0, 0, -1 };
+
+void filter_shared(picture_pool *pool, filter_job *job, picture *pict, picture *newpict,
+	int taskid, int numtasks)
+{
+	picture view;
+	picture local_newpict;
+	int i, r, col, halo = op_halo(job);
+	int *in, *out;
+	band b;
+
+	if (!shared_init(taskid, numtasks))
+	{
+		filter_job plain = *job;
+		plain.stream = 0; // written by run_job
+		filter_bands(pool, &plain, pict, newpict, taskid, numtasks);
+		return;
+	}
+
+	col = shm.col;
+	in = shm.base;
+	out = shm.base + (size_t)IM_SIZE * col;
+
+	/* a picture not read into the window is copied in */
+	if (taskid == 0 && pict->data != in)
+		for (i = 0; i < job->height; i++)
+			memcpy(in + (size_t)i * col, pict->data + i * pict->col, job->width * sizeof(int));
+	MPI_Win_sync(shm.win);
+	MPI_Barrier(shm.node);
+	MPI_Win_sync(shm.win);
+
+	/* filter own band straight from the window */
+	band_split(job->height, numtasks, halo, taskid, &b);
+	r = b.top + b.rows + b.bottom;
+	view.row = r;
+	view.col = col;
+	view.data = in + (size_t)(b.first - b.top) * col;
+	if (PicturePoolNew(pool, &local_newpict, r, job->width, 0) != 1)
+		printf("creating local new picture matrix at workder %d failed\n", taskid);
+
+	TRACE_BEGIN(op_names[job->op]);
+	if (b.rows > 0)
+		apply_op(job, &view, r, job->width, &local_newpict);
+	TRACE_END(op_names[job->op]);
+	for (i = 0; i < b.rows; i++)
+		memcpy(out + (size_t)(b.first + i) * col, local_newpict.data + (b.top + i) * local_newpict.col,
+			job->width * sizeof(int));
+
+	MPI_Win_sync(shm.win);
+	MPI_Barrier(shm.node);
+	MPI_Win_sync(shm.win);
+	if (taskid == 0 && newpict->data != out)
+		for (i = 0; i < job->height; i++)
+			memcpy(newpict->data + i * newpict->col, out + (size_t)i * col, job->width * sizeof(int));
+
+	/* nobody writes the input of the next job before root read the output */
+	MPI_Barrier(shm.node);
+	PictureRelease(pool, &local_newpict);
+	return;
+	/* End filter_shared function                                                 */
+}
+
+/* Begin shared window functions                                              */
+/******************************************************************************/
+/* Purpose : shared_init checks once whether all tasks are on this host and   */
+/*           then allocates the window, an input and an output picture of     */
+/*           IM_SIZE rows, returns 1 if it is usable. shared_views points     */
+/*           root's pict and newpict at the two halves, so the picture is     */
+/*           read into and written from the window without copies.            */
+/*           shared_free frees the window of filter_shared and its            */
+/*           communicator, called by all tasks at the end. All of them are    */
+/*           collective.                                                      */
+/******************************************************************************/
+/* Source Code:                                                               */
+int shared_init(int taskid, int numtasks)
+{
+	int i;
+
+	if (shm.usable >= 0)
+		return shm.usable;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &shm.node);
+	MPI_Comm_size(shm.node, &i);
+	shm.usable = i == numtasks;
+	if (!shm.usable)
+	{
+		if (taskid == 0)
+			printf("tasks are on more than one host, no shared memory\n");
+		return 0;
+	}
+
+	/* rows padded like pool pictures */
+	shm.col = (IM_SIZE + PICT_ALIGN / (int)sizeof(int) - 1) & ~(PICT_ALIGN / (int)sizeof(int) - 1);
+	shm.ints = (size_t)2 * IM_SIZE * shm.col;
+	MPI_Win_allocate_shared(taskid == 0 ? (MPI_Aint)(shm.ints * sizeof(int)) : 0, sizeof(int),
+		MPI_INFO_NULL, shm.node, &shm.base, &shm.win);
+	if (taskid != 0)
+	{
+		MPI_Aint size;
+		int disp;
+		MPI_Win_shared_query(shm.win, 0, &size, &disp, &shm.base);
+	}
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, shm.win);
+	return 1;
+}
+
+int shared_views(picture *pict, picture *newpict, int taskid, int numtasks)
+{
+	if (!shared_init(taskid, numtasks))
+		return 0;
+	if (taskid == 0)
+	{
+		pict->row = newpict->row = IM_SIZE;
+		pict->col = newpict->col = shm.col;
+		pict->data = shm.base;
+		newpict->data = shm.base + (size_t)IM_SIZE * shm.col;
+	}
+	return 1;
+}
+
+void shared_free(void)
+{
+	if (shm.win != MPI_WIN_NULL)
+	{
+		MPI_Win_unlock_all(shm.win);
+		MPI_Win_free(&shm.win);
+	}
+	if (shm.node != MPI_COMM_NULL)
+		MPI_Comm_free(&shm.node);
+	shm.base = NULL;
+	shm.ints = 0;
+	shm.usable = -1;
+	return;
+	/* End shared window functions                                                */
+}
+
+/* Begin band_split function                                                  */
+/******************************************************************************/
+/* Purpose : Give task taskid an even share of height rows, plus up to halo   */
+/*           rows above and below it that are still inside the picture.       */
+/******************************************************************************/
+/* Source Code:                                                               */
+void band_split(int height, int numtasks, int halo, int taskid, band *b)
+{
+	int aveheight = height / numtasks;
+	int extra = height % numtasks;
+
+	b->rows = aveheight + (taskid < extra ? 1 : 0);
+	b->first = taskid * aveheight + (taskid < extra ? taskid : extra);
+	b->top = b->first < halo ? b->first : halo;
+	b->bottom = height - b->first - b->rows < halo ? height - b->first - b->rows : halo;
+	return;
+	/* End band_split function                                                    */
+}
+
+/* Begin serve_jobs function                                                  */
+/******************************************************************************/
+/* Purpose : Keep MPI and the picture buffers alive and filter one job per    */
+/*           request line read from the named pipe PIPE_NAME. A request is    */
+/*           "<in.pgm> <out.pgm> [9 filter values | median R | box R |       */
+/*           erode/dilate/open/close RX [RY]]" or                             */
+/*           "quit", nothing may follow the filter. Each answer is            */
+/*           "ok <ms>" or "error <reason>". job holds the                     */
+/*           defaults from the command line on entry.                         */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* pipe                   HANDLE   named pipe, one client at a time           */
+/* line[]                 char     request / answer line                      */
+/* reason[]               char     why the filter of a request is refused     */
+/* start                  DWORD    tick count at request                      */
+/******************************************************************************/
+/* Source Code:                                                               */
+void serve_jobs(picture_pool *pool, filter_job *job, picture *pict, picture *newpict, int numtasks)
+{
+	filter_job def = *job;
+	char line[3 * JOB_PATH], reason[80];
+	HANDLE pipe;
+	DWORD start, sent;
+	int k, quit = 0;
+
+	pipe = CreateNamedPipeA(PIPE_NAME, PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_WAIT,
+		1, 4096, 4096, 0, NULL);
+	if (pipe == INVALID_HANDLE_VALUE)
+	{
+		printf("Error creating pipe %s\n", PIPE_NAME);
+		quit = 1;
+	}
+	else
+		printf("serving filter jobs on %s\n", PIPE_NAME);
+
+	while (!quit)
+	{
+		/* wait for a client, it may send many jobs before closing */
+		if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+			break;
+
+		while (!quit && pipe_readline(pipe, line, sizeof(line)) == 1)
+		{
+			start = GetTickCount();
+			*job = def;
+
+			if (strcmp(line, "quit") == 0)
+			{
+				quit = 1;
+				strcpy(line, "ok\n");
+			}
+			else if (sscanf(line, "%259s %259s%n", job->in, job->out, &k) != 2)
+				strcpy(line, "error need <in.pgm> <out.pgm>\n");
+			else if (!serve_filter(line + k, job, reason))
+				sprintf(line, "error %s\n", reason);
+			else if (read_pict(job->in, pict, &job->height, &job->width, &job->maxval) != 1)
+				sprintf(line, "error reading %s\n", job->in);
+			else if (!op_radius_ok(job))
+				sprintf(line, "error radius %d %d out of range\n", job->radius, job->radius_y);
+			else
+			{
+				MPI_Bcast(job, sizeof(filter_job), MPI_BYTE, 0, MPI_COMM_WORLD);
+				run_job(pool, job, pict, newpict, 0, numtasks);
+				if (!job->stream)
+					write_pict(job->out, newpict, job->height, job->width, job->maxval);
+				sprintf(line, "ok %d\n", (int)(GetTickCount() - start));
+			}
+			WriteFile(pipe, line, (DWORD)strlen(line), &sent, NULL);
+		}
+		FlushFileBuffers(pipe);
+		DisconnectNamedPipe(pipe);
+	}
+
+	/* release workers */
+	memset(job, 0, sizeof(filter_job));
+	job->quit = 1;
+	MPI_Bcast(job, sizeof(filter_job), MPI_BYTE, 0, MPI_COMM_WORLD);
+	if (pipe != INVALID_HANDLE_VALUE)
+		CloseHandle(pipe);
+	return;
+	/* End serve_jobs function                                                    */
+}
+
+/* read one request line from the pipe, without the line end */
+int pipe_readline(HANDLE pipe, char *line, int max)
+{
+	DWORD got;
+	char ch;
+	int n = 0;
+
+	while (n < max - 1)
+	{
+		if (!ReadFile(pipe, &ch, 1, &got, NULL) || got == 0)
+			return 0;
+		if (ch == '\n')
+			break;
+		if (ch != '\r')
+			line[n++] = ch;
+	}
+	line[n] = '\0';
+	return 1;
+}
+
+/* optional filter p after the two file names of a request into job, 1 if it */
+/* is empty, an operation with its radii or exactly 9 values, else 0 and why */
+int serve_filter(const char *p, filter_job *job, char *reason)
+{
+	double flt[FILTER_SIZE][FILTER_SIZE];
+	char name[16], *end;
+	int i, n, max, value[2];
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (*p == '\0')
+		return 1;
+
+	strtod(p, &end);
+	if (end != p)
+	{
+		/* kernel, row by row */
+		for (i = 0; i < FILTER_SIZE * FILTER_SIZE; i++, p = end)
+		{
+			flt[i / FILTER_SIZE][i % FILTER_SIZE] = strtod(p, &end);
+			if (end == p)
+				break;
+		}
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (i < FILTER_SIZE * FILTER_SIZE || *p != '\0')
+		{
+			sprintf(reason, "need %d filter values", FILTER_SIZE * FILTER_SIZE);
+			return 0;
+		}
+		memcpy(job->flt, flt, sizeof(flt));
+	}
+	else if (sscanf(p, "%15s%n", name, &n) == 1 && op_by_name(name) >= 0)
+	{
+		/* operation, R or RX [RY] */
+		p += n;
+		max = op_by_name(name) >= OP_ERODE ? 2 : 1;
+		for (i = 0; i < max; i++, p = end)
+		{
+			value[i] = (int)strtol(p, &end, 10);
+			if (end == p)
+				break;
+		}
+		if (i == 0)
+		{
+			sprintf(reason, "need radius of %s", name);
+			return 0;
+		}
+		job->op = op_by_name(name);
+		job->radius = value[0];
+		job->radius_y = i == 2 ? value[1] : value[0];
+	}
+	else
+	{
+		sprintf(reason, "unknown filter %s", name);
+		return 0;
+	}
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (*p != '\0')
+	{
+		sprintf(reason, "unexpected %.40s", p);
+		return 0;
+	}
+	return 1;
+}
+
+/* Begin bench_run function                                                   */
+/******************************************************************************/
+/* Purpose : Performance regression suite, -bench. Times every path of       */
+/*           bench_names[] on synthetic pictures of BENCH_SIZES heights (one  */
+/*           warm up, then the median of BENCH_TRIALS runs) and compares with */
+/*           the entries of this host in BENCH_FILE. A path slower than its   */
+/*           baseline by more than threshold percent fails the suite, as does */
+/*           an output of original.pgm different from new1.pgm. Timings only  */
+/*           compare on the host that made them, so none are shipped: the     */
+/*           first run of a host records its baseline and only checks the     */
+/*           output, later runs compare. -rebase records a new baseline.      */
+/*           Called by all tasks, returns 1 if passed (root only).            */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* bd                     bench_data  pictures and matrix of the trials       */
+/* ms[][]                 double   median milliseconds of path and size       */
+/* base[][]               double   baseline milliseconds, 0 = none            */
+/* missing                int      # of paths and sizes without baseline      */
+/* t[]                    double   milliseconds of every trial                */
+/******************************************************************************/
+/* Source Code:                                                               */
+const char *bench_names[BENCH_PATHS] = { "write", "read", "image_filter", "median_filter",
+	"box_filter", "scatter_gather", "filter_bands", "matvec" };
+
+int bench_run(picture_pool *pool, filter_job *job, int taskid, int numtasks,
+	double threshold, int rebase)
+{
+	const int heights[BENCH_SIZES] = { IM_SIZE, 4 * IM_SIZE };
+	double ms[BENCH_PATHS][BENCH_SIZES], base[BENCH_PATHS][BENCH_SIZES] = { { 0 } };
+	double t[BENCH_TRIALS], t0, tmp;
+	char host[MPI_MAX_PROCESSOR_NAME];
+	int i, k, p, z, len, ok, record = rebase, missing = 0;
+	bench_data bd;
+	FILE *f;
+
+	MPI_Get_processor_name(host, &len);
+	ok = bench_check(pool, job, taskid, numtasks);
+
+	for (z = 0; z < BENCH_SIZES; z++)
+	{
+		/* synthetic picture, noise over a ramp, and the matrix of matvec */
+		bd.job = *job;
+		bench_job(&bd.job);
+		bd.job.height = heights[z];
+		bd.job.width = IM_SIZE;
+		bd.job.mode = MODE_BANDS;
+		bd.nmat = 4 * heights[z];
+		bd.mat = NULL;
+		bd.vec = (int*)malloc(bd.nmat * sizeof(int));
+		for (i = 0; i < bd.nmat; i++)
+			bd.vec[i] = 1;
+		if (taskid == 0)
+		{
+			if (PicturePoolNew(pool, &bd.pict, bd.job.height, bd.job.width, 0) != 1 ||
+				PicturePoolNew(pool, &bd.out, bd.job.height, bd.job.width, 0) != 1)
+				printf("creating bench picture matrix failed\n");
+			srand(z + 1);
+			for (i = 0; i < bd.job.height; i++)
+				for (k = 0; k < bd.job.width; k++)
+					bd.pict.data[i*bd.pict.col + k] = (i + k) / 4 % 192 + rand() % 64;
+			bd.mat = (int*)malloc((size_t)bd.nmat * bd.nmat * sizeof(int));
+			for (i = 0; i < bd.nmat * bd.nmat; i++)
+				bd.mat[i] = i % 7;
+		}
+
+		for (p = 0; p < BENCH_PATHS; p++)
+		{
+			/* first run is a warm up */
+			for (k = -1; k < BENCH_TRIALS; k++)
+			{
+				MPI_Barrier(MPI_COMM_WORLD);
+				t0 = MPI_Wtime();
+				bench_once(pool, &bd, p, taskid, numtasks);
+				if (k >= 0)
+					t[k] = (MPI_Wtime() - t0) * 1000;
+			}
+			for (i = 1; i < BENCH_TRIALS; i++)
+				for (k = i; k > 0 && t[k - 1] > t[k]; k--)
+				{
+					tmp = t[k];
+					t[k] = t[k - 1];
+					t[k - 1] = tmp;
+				}
+			ms[p][z] = t[BENCH_TRIALS / 2];
+		}
+
+		free(bd.vec);
+		if (taskid == 0)
+		{
+			free(bd.mat);
+			PictureRelease(pool, &bd.pict);
+			PictureRelease(pool, &bd.out);
+		}
+	}
+	if (taskid != 0)
+		return 1;
+
+	/* baseline of this host, last entry wins */
+	if ((f = fopen(BENCH_FILE, "r")) != NULL)
+	{
+		char line[300], name[MPI_MAX_PROCESSOR_NAME], path[32];
+		double v;
+
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "%255s %31s %d %lf", name, path, &k, &v) == 4 && strcmp(name, host) == 0)
+				for (p = 0; p < BENCH_PATHS; p++)
+					for (z = 0; z < BENCH_SIZES; z++)
+						if (strcmp(path, bench_names[p]) == 0 && k == heights[z])
+							base[p][z] = v;
+		fclose(f);
+	}
+
+	printf("%-16s %6s %10s %10s %8s\n", "path", "height", "ms", "baseline", "change");
+	for (p = 0; p < BENCH_PATHS; p++)
+		for (z = 0; z < BENCH_SIZES; z++)
+		{
+			if (base[p][z] <= 0)
+			{
+				record = 1;
+				missing++;
+				printf("%-16s %6d %10.3f %10s\n", bench_names[p], heights[z], ms[p][z], "-");
+				continue;
+			}
+			tmp = (ms[p][z] / base[p][z] - 1) * 100;
+			printf("%-16s %6d %10.3f %10.3f %+7.1f%%%s\n", bench_names[p], heights[z], ms[p][z],
+				base[p][z], tmp, tmp > threshold ? " SLOWER" : "");
+			if (tmp > threshold)
+				ok = 0;
+		}
+
+	if (record)
+	{
+		f = fopen(BENCH_FILE, "a");
+		if (f == NULL)
+			printf("Error writing %s\n", BENCH_FILE);
+		else
+		{
+			for (p = 0; p < BENCH_PATHS; p++)
+				for (z = 0; z < BENCH_SIZES; z++)
+					fprintf(f, "%s %s %d %.3f\n", host, bench_names[p], heights[z], ms[p][z]);
+			fclose(f);
+			printf("baseline of %s written to %s\n", host, BENCH_FILE);
+		}
+	}
+	if (ok && missing)
+		printf("bench recorded %d baseline entries, run -bench again to compare\n", missing);
+	else
+		printf("bench %s (threshold %.1f%%)\n", ok ? "passed" : "FAILED", threshold);
+	return ok;
+	/* End bench_run function                                                     */
+}
+
+/* Begin bench_once function                                                  */
+/******************************************************************************/
+/* Purpose : One run of path p of bench_names[] on bd, called by all tasks.   */
+/*           Only scatter_gather, filter_bands and matvec use the workers,    */
+/*           matvec sends every worker its rows like sendrcv.c.               */
+/******************************************************************************/
+/* Source Code:                                                               */
+void bench_once(picture_pool *pool, bench_data *bd, int p, int taskid, int numtasks)
+{
+	MPI_Status status;
+	filter_job op = bd->job;
+	picture local;
+	int *counts = NULL, *displs = NULL, *rows = NULL, *res = NULL;
+	int i, j, r, c;
+	band b, bk;
+
+	switch (p)
+	{
+	case BENCH_WRITE:
+		if (taskid == 0)
+			write_pict(BENCH_PICT, &bd->pict, bd->job.height, bd->job.width, bd->job.maxval);
+		break;
+	case BENCH_READ:
+		if (taskid == 0 && read_pict(BENCH_PICT, &bd->out, &r, &c, NULL) != 1)
+			printf("bench read of %s failed\n", BENCH_PICT);
+		break;
+	case BENCH_CONV:
+	case BENCH_MEDIAN:
+	case BENCH_BOX:
+		op.op = p == BENCH_CONV ? OP_CONV : p == BENCH_MEDIAN ? OP_MEDIAN : OP_BOX;
+		op.radius = p == BENCH_BOX ? 2 : 1;
+		if (taskid == 0)
+			apply_op(&op, &bd->pict, op.height, op.width, &bd->out);
+		break;
+	case BENCH_SCATTER:
+		/* the data movement of filter_bands without the filter */
+		band_split(op.height, numtasks, 0, taskid, &b);
+		if (PicturePoolNew(pool, &local, b.rows, IM_SIZE, 0) != 1)
+			printf("creating bench band at worker %d failed\n", taskid);
+		if (taskid == 0)
+		{
+			counts = (int*)malloc(2 * numtasks * sizeof(int));
+			displs = counts + numtasks;
+			for (i = 0; i < numtasks; i++)
+			{
+				band_split(op.height, numtasks, 0, i, &bk);
+				counts[i] = bk.rows * bd->pict.col;
+				displs[i] = bk.first * bd->pict.col;
+			}
+		}
+		MPI_Scatterv(taskid == 0 ? bd->pict.data : NULL, counts, displs, MPI_INT,
+			local.data, b.rows * local.col, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Gatherv(local.data, b.rows * local.col, MPI_INT,
+			taskid == 0 ? bd->out.data : NULL, counts, displs, MPI_INT, 0, MPI_COMM_WORLD);
+		free(counts);
+		PictureRelease(pool, &local);
+		break;
+	case BENCH_BANDS:
+		filter_bands(pool, &op, taskid == 0 ? &bd->pict : NULL, taskid == 0 ? &bd->out : NULL,
+			taskid, numtasks);
+		break;
+	case BENCH_MATVEC:
+		/* root sends the rows of every worker and keeps its own */
+		band_split(bd->nmat, numtasks, 0, taskid, &b);
+		res = (int*)malloc(bd->nmat * sizeof(int));
+		if (taskid == 0)
+		{
+			for (i = 1; i < numtasks; i++)
+			{
+				band_split(bd->nmat, numtasks, 0, i, &bk);
+				MPI_Send(bd->mat + (size_t)bk.first * bd->nmat, bk.rows * bd->nmat, MPI_INT,
+					i, TAG_TILE, MPI_COMM_WORLD);
+			}
+			rows = bd->mat;
+		}
+		else
+		{
+			rows = (int*)malloc((size_t)b.rows * bd->nmat * sizeof(int));
+			MPI_Recv(rows, b.rows * bd->nmat, MPI_INT, 0, TAG_TILE, MPI_COMM_WORLD, &status);
+		}
+		for (i = 0; i < b.rows; i++)
+		{
+			res[b.first + i] = 0;
+			for (j = 0; j < bd->nmat; j++)
+				res[b.first + i] += rows[(size_t)i * bd->nmat + j] * bd->vec[j];
+		}
+		if (taskid == 0)
+		{
+			for (i = 1; i < numtasks; i++)
+			{
+				band_split(bd->nmat, numtasks, 0, i, &bk);
+				MPI_Recv(res + bk.first, bk.rows, MPI_INT, i, TAG_DONE, MPI_COMM_WORLD, &status);
+			}
+		}
+		else
+		{
+			MPI_Send(res + b.first, b.rows, MPI_INT, 0, TAG_DONE, MPI_COMM_WORLD);
+			free(rows);
+		}
+		free(res);
+		break;
+	}
+	return;
+	/* End bench_once function                                                    */
+}
+
+/* Begin bench_check function                                                 */
+/******************************************************************************/
+/* Purpose : Filter original.pgm as the default job and compare with the      */
+/*           reference new1.pgm, returns 1 if every pixel is the same.        */
+/******************************************************************************/
+/* Source Code:                                                               */
+int bench_check(picture_pool *pool, filter_job *job, int taskid, int numtasks)
+{
+	filter_job check = *job;
+	picture pict, out, ref;
+	int i, j, r, c, ndiff = 0, ok = 1;
+
+	bench_job(&check);
+	check.mode = MODE_BANDS;
+	check.op = OP_CONV;
+	strcpy(check.in, "original.pgm");
+	if (taskid == 0)
+	{
+		PicturePoolNew(pool, &pict, IM_SIZE, IM_SIZE, 0);
+		PicturePoolNew(pool, &out, IM_SIZE, IM_SIZE, 0);
+		PicturePoolNew(pool, &ref, IM_SIZE, IM_SIZE, 0);
+		if (read_pict(check.in, &pict, &check.height, &check.width, &check.maxval) != 1 ||
+			read_pict(BENCH_REF, &ref, &r, &c, NULL) != 1 || r != check.height || c != check.width)
+			check.quit = 1;
+	}
+	MPI_Bcast(&check, sizeof(filter_job), MPI_BYTE, 0, MPI_COMM_WORLD);
+	if (!check.quit)
+		run_job(pool, &check, taskid == 0 ? &pict : NULL, taskid == 0 ? &out : NULL, taskid, numtasks);
+	if (taskid != 0)
+		return 1;
+
+	for (i = 0; i < check.height && !check.quit; i++)
+		for (j = 0; j < check.width; j++)
+			if (out.data[i*out.col + j] != ref.data[i*ref.col + j])
+				ndiff++;
+	if (check.quit)
+	{
+		printf("bench check: could not read %s or %s\n", check.in, BENCH_REF);
+		ok = 0;
+	}
+	else
+	{
+		printf("bench check: %d pixels differ from %s\n", ndiff, BENCH_REF);
+		ok = ndiff == 0;
+	}
+	PictureRelease(pool, &pict);
+	PictureRelease(pool, &out);
+	PictureRelease(pool, &ref);
+	return ok;
+	/* End bench_check function                                                   */
+}
+
+/* the same paths whatever the command line asked for: no streaming, no */
+/* pyramid, no autotune and the integer filter only where it is exact    */
+void bench_job(filter_job *job)
+{
+	job->stream = 0;
+	job->levels = 0;
+	job->autotune = 0;
+	job->fixed = FIX_AUTO;
+	return;
+}
+
+int PictureNew(picture *m, int x, int y)
+{
+	m->row = x;
+	m->col = y;
+	m->data = (int*)calloc(m->row*m->col, sizeof(int));
+
+	if (m->data)
+		return 1;
+	else
+		return 0;
+}
+
+/* Begin picture pool functions                                               */
+/******************************************************************************/
+/* Purpose : Hand out PICT_ALIGN aligned picture buffers and keep released    */
+/*           ones for the next frame or filter pass. Rows are padded so that  */
+/*           col is a multiple of PICT_ALIGN bytes, col is the row stride and */
+/*           callers pass the real width separately (as image_filter does).   */
+/*           Zeroing is only done when asked, most callers overwrite it all.  */
+/*           With pool->touch new buffers are zeroed by the filter threads,   */
+/*           see first_touch.                                                 */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* pool                   picture_pool *  pool to take buffer from            */
+/* m                      picture *       picture to fill                     */
+/* x                      int      # of rows                                  */
+/* y                      int      # of column (rounded up for row stride)    */
+/* zero                   int      1 = clear buffer before returning it       */
+/* bytes                  size_t   buffer size needed                         */
+/* best                   int      smallest free slot big enough, -1 if none  */
+/******************************************************************************/
+/* Source Code:                                                               */
+void PoolInit(picture_pool *pool)
+{
+	memset(pool, 0, sizeof(picture_pool));
+}
+
+int PicturePoolNew(picture_pool *pool, picture *m, int x, int y, int zero)
+{
+	const int pad = PICT_ALIGN / sizeof(int);
+	size_t bytes;
+	int i, best = -1, fresh = 0;
+
+	m->row = x;
+	m->col = (y + pad - 1) / pad * pad;
+	m->data = NULL;
+	bytes = (size_t)m->row * m->col * sizeof(int);
+
+	/* reuse the smallest released buffer that fits */
+	for (i = 0; i < pool->nslot; i++)
+		if (!pool->slot[i].used && pool->slot[i].bytes >= bytes &&
+			(best < 0 || pool->slot[i].bytes < pool->slot[best].bytes))
+			best = i;
+
+	if (best >= 0)
+	{
+		pool->bytes_reused += bytes;
+		pool->n_reuse++;
+	}
+	else
+	{
+		/* take an empty slot, or drop a released buffer that is too small */
+		for (i = 0; i < pool->nslot && best < 0; i++)
+			if (!pool->slot[i].used)
+			{
+				_aligned_free(pool->slot[i].ptr);
+				best = i;
+			}
+		if (best < 0)
+		{
+			if (pool->nslot == POOL_SLOTS)
+				return 0;
+			best = pool->nslot++;
+		}
+		pool->slot[best].ptr = _aligned_malloc(bytes, PICT_ALIGN);
+		pool->slot[best].bytes = bytes;
+		if (pool->slot[best].ptr == NULL)
+		{
+			pool->slot[best].bytes = 0;
+			return 0;
+		}
+		pool->bytes_alloc += bytes;
+		pool->n_alloc++;
+		fresh = 1;
+	}
+
+	pool->slot[best].used = 1;
+	m->data = (int*)pool->slot[best].ptr;
+	if (pool->touch && (zero || fresh))
+		first_touch(m);
+	else if (zero)
+		memset(m->data, 0, bytes);
+	return 1;
+}
+
+void PictureRelease(picture_pool *pool, picture *m)
+{
+	int i;
+
+	for (i = 0; i < pool->nslot; i++)
+		if (pool->slot[i].ptr == m->data)
+			pool->slot[i].used = 0;
+	m->data = NULL;
+}
+
+void PoolFree(picture_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->nslot; i++)
+		_aligned_free(pool->slot[i].ptr);
+	PoolInit(pool);
+}
+
+void PoolStats(picture_pool *pool, int taskid)
+{
+	printf("pool at worker %d: %d alloc (%zu bytes), %d reuse (%zu bytes)\n", taskid,
+		pool->n_alloc, pool->bytes_alloc, pool->n_reuse, pool->bytes_reused);
+	if (numa.pinned)
+		numa_stats(pool, taskid);
+}
+/* End picture pool functions                                                 */
+
+
+/* Begin numa functions                                                       */
+/******************************************************************************/
+/* Purpose : Keep every OpenMP thread on one core and the pages of the pool   */
+/*           on the NUMA node of the thread that filters them, for -pin.      */
+/*           numa_pin       pin threads, consecutive threads on one node as  */
+/*                          schedule(static) gives them consecutive rows,     */
+/*                          the tasks of a host each take their own cores     */
+/*           first_touch    write a new buffer row by row with the same      */
+/*                          static schedule, so its pages land on the nodes   */
+/*                          of the threads that filter those rows             */
+/*           numa_stats     print the pinning and the node of the pages of   */
+/*                          every pool buffer (QueryWorkingSetEx)             */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* numa                   numa_place  core and node of every thread           */
+/* mask[]                 ULONGLONG   processors of every node                */
+/* nodes                  int      # of NUMA nodes                            */
+/* pages[]                int      # of pages of a buffer on every node       */
+/******************************************************************************/
+/* Source Code:                                                               */
+numa_place numa = { 0 };
+
+void numa_pin(int threads)
+{
+	ULONGLONG mask[NUMA_MAX_NODES];
+	ULONG highest = 0;
+	MPI_Comm host;
+	int n, nodes;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > NUMA_MAX_THREADS)
+		threads = NUMA_MAX_THREADS;
+	if (numa.pinned == threads)
+		return;
+	if (numa.ranks == 0)
+	{
+		MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &host);
+		MPI_Comm_rank(host, &numa.rank);
+		MPI_Comm_size(host, &numa.ranks);
+		MPI_Comm_free(&host);
+	}
+
+	GetNumaHighestNodeNumber(&highest);
+	nodes = highest + 1 < NUMA_MAX_NODES ? highest + 1 : NUMA_MAX_NODES;
+	for (n = 0; n < nodes; n++)
+		if (!GetNumaNodeProcessorMask((UCHAR)n, &mask[n]))
+			mask[n] = 0;
+
+#pragma omp parallel num_threads(threads)
+	{
+		int t = 0, s, k, c, node, core = -1;
+		const int total = numa.ranks * threads;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		/* thread s of the host is the k-th of its node, on the k-th core of it */
+		s = numa.rank * threads + t;
+		node = s * nodes / total;
+		k = s - (node * total + nodes - 1) / nodes;
+		for (c = 0; mask[node] != 0; c = (c + 1) % 64)
+			if (mask[node] >> c & 1 && k-- == 0)
+			{
+				core = c;
+				break;
+			}
+		if (core >= 0)
+			SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+		numa.core[t] = core;
+		numa.node[t] = node;
+	}
+	numa.pinned = threads;
+	numa.nodes = nodes;
+	return;
+}
+
+void first_touch(picture *m)
+{
+	int i;
+
+#pragma omp parallel for schedule(static)
+	for (i = 0; i < m->row; i++)
+		memset(m->data + (size_t)i * m->col, 0, m->col * sizeof(int));
+	return;
+}
+
+void numa_stats(picture_pool *pool, int taskid)
+{
+	PSAPI_WORKING_SET_EX_INFORMATION info[NUMA_SAMPLE];
+	int pages[NUMA_MAX_NODES + 1];
+	size_t page, npage, step;
+	int i, k, n, nodes = numa.nodes < 1 ? 1 : numa.nodes;
+
+	printf("worker %d threads:", taskid);
+	for (i = 0; i < numa.pinned; i++)
+		printf(" %d:core %d node %d", i, numa.core[i], numa.node[i]);
+	printf("\n");
+
+	/* node of up to NUMA_SAMPLE pages of every buffer, last count is not in memory */
+	for (i = 0; i < pool->nslot; i++)
+	{
+		page = (size_t)pool->slot[i].ptr & ~(size_t)(NUMA_PAGE - 1);
+		npage = ((size_t)pool->slot[i].ptr + pool->slot[i].bytes - page + NUMA_PAGE - 1) / NUMA_PAGE;
+		step = npage / NUMA_SAMPLE + 1;
+		for (k = 0; k < NUMA_SAMPLE && k * step < npage; k++)
+			info[k].VirtualAddress = (PVOID)(page + k * step * NUMA_PAGE);
+		memset(pages, 0, sizeof(pages));
+		if (k > 0 && QueryWorkingSetEx(GetCurrentProcess(), info, k * sizeof(info[0])))
+			for (n = 0; n < k; n++)
+				pages[info[n].VirtualAttributes.Valid ? info[n].VirtualAttributes.Node % nodes : nodes]++;
+		printf("worker %d buffer %d (%zu bytes) pages on node:", taskid, i, pool->slot[i].bytes);
+		for (n = 0; n < nodes; n++)
+			printf(" %d", pages[n]);
+		printf(", not in memory %d\n", pages[nodes]);
+	}
+	return;
+	/* End numa functions                                                         */
+}
+
+/* Begin read_pict function                                                   */
+/******************************************************************************/
+/* Purpose : This function reads the image from fname, returns 1 if success   */
+/*           and the maximum pixel value in maxval (if not NULL), raised to   */
+/*           the largest pixel found if the file understates it.              */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* fname                  char *   file name (original.pgm)                   */
+/* pict[][]               int      array address                              */
+/* r                      int *    # of rows pointer                          */
+/* c                      int *    # of column pointer                        */
+/* maxval                 int *    maximum pixel value pointer                */
+/* max                    int      maximum pixel value                        */
+/* i                      int      loop counter                               */
+/* j                      int      loop counter                               */
+/* line[200]              char     string                                     */
+/* in                     FILE *   input file pointer                         */
+/******************************************************************************/
+/* Source Code:                                                               */
+int read_pict(const char *fname, picture *pict, int *r, int *c, int *maxval)
+{
+	int i, j, max;
+	FILE *in;
+	char line[200];
+
+	TRACE_BEGIN("read_pict");
+
+	in = fopen(fname, "r");	// f16 image
+	if (in == NULL)
+	{
+		printf("Error reading %s\n", fname);
+		TRACE_END("read_pict");
+		return 0;
+	}
+
+	fgets(line, 199, in); // get PGM Type
+
+	line[strlen(line) - 1] = '\0';  // get rid of '\n'
+
+	if (strcmp(line, "P2") != 0)
+	{
+		printf("Cannot process %s PGM format, only P2 type\n", line);
+		fclose(in);
+		TRACE_END("read_pict");
+		return 0;
+	}
+
+	fgets(line, 199, in); // get comment
+
+	fscanf(in, "%d %d", c, r); // get size width x height
+
+	if (*r < 1 || *c < 1 || *r > pict->row || *c > pict->col)
+	{
+		printf("Cannot process %d x %d picture, maximum is %d x %d\n", *c, *r, pict->col, pict->row);
+		fclose(in);
+		TRACE_END("read_pict");
+		return 0;
+	}
+
+	fscanf(in, "%d", &max); // get maximum pixel value
+
+	for (i = 0; i < *r; i++)
+		for (j = 0; j < *c; j++)
+		{
+			fscanf(in, "%d", &pict->data[i*pict->col + j]);
+			if (abs(pict->data[i*pict->col + j]) > max)
+				max = abs(pict->data[i*pict->col + j]);
+		}
+	fclose(in);
+	if (maxval != NULL)
+		*maxval = max;
+	TRACE_END("read_pict");
+
+	return 1;
+	/* End read_pict function                                                     */
+}
+
+/* Begin image_filter function                                                */
+/******************************************************************************/
+/* Purpose : This function filter the image and create a new image            */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* pict[][]               int      array address                              */
+/* new_pict[][]           int      array address                              */
+/* r                      int      # of rows                                  */
+/* c                      int      # of column                                */
+/* i                      int      loop counter                               */
+/* j                      int      loop counter                               */
+/* m                      int      loop counter                               */
+/* n                      int      loop counter                               */
+/* coeff                  double   coefficient                                */
+/* sum                    double   sum                                        */
+/******************************************************************************/
+/* Source Code:                                                               */
+void image_filter(picture *pict, int r, int c, double filter[][FILTER_SIZE],
+	picture *new_pict)
+{
+	double coeff = 0;
+	double sum;
+	int i, j, m, n;
+
+	/*  copy edges                                                                */
+	for (i = 0; i < r; i++)
+	{
+		new_pict->data[i*new_pict->col + 0] = pict->data[i*pict->col + 0];
+		new_pict->data[i*new_pict->col + c - 1] = pict->data[i*pict->col + c - 1];
+	}
+
+	for (j = 0; j < c; j++)
+	{
+		new_pict->data[0 * new_pict->col + j] = pict->data[0 * pict->col + j];
+		new_pict->data[(r - 1)*new_pict->col + j] = pict->data[(r - 1)*pict->col + j];
+	}
+
+	/*  compute coefficient                                                       */
+	for (i = 0; i < FILTER_SIZE; i++)
+		for (j = 0; j < FILTER_SIZE; j++)
+			coeff += filter[i][j];
+
+	/*  filter the image                                                          */
+#pragma omp parallel for private(j, m, n, sum)
+	for (i = 1; i < r - 1; i++)
+		for (j = 1; j < c - 1; j++)
+		{
+			sum = 0;
+			for (m = 0; m < FILTER_SIZE; m++)
+				for (n = 0; n < FILTER_SIZE; n++)
+					sum += pict->data[(i + (m - 1))*pict->col + (j + (n - 1))] * filter[m][n];
+			new_pict->data[i*new_pict->col + j] = (int)sum;
+		}
+
+	if (coeff != 0)
+	{
+#pragma omp parallel for private(j)
+		for (i = 1; i < r - 1; i++)
+			for (j = 1; j < c - 1; j++)
+				new_pict->data[i*new_pict->col + j] = (int)(new_pict->data[i*new_pict->col + j] / coeff);
+	}
+
+	/*  check for pixel > 255 and pixel < 0                                       */
+#pragma omp parallel for private(j)
+	for (i = 1; i < r - 1; i++)
+		for (j = 1; j < c - 1; j++)
+		{
+			if (new_pict->data[i*new_pict->col + j] < 0)
+				new_pict->data[i*new_pict->col + j] = 0;
+			else if (new_pict->data[i*new_pict->col + j] > 255)
+				new_pict->data[i*new_pict->col + j] = 255;
+		}
+
+	return;
+	/* End image_filter function                                                  */
+}
+
+/* Begin apply_op function                                                    */
+/******************************************************************************/
+/* Purpose : Run the operation of a job on one band, op_halo gives the rows   */
+/*           of halo the operation needs above and below the band and         */
+/*           op_by_name the operation for a command line / request name,      */
+/*           op_halo_x the columns of halo left and right of a region,        */
+/*           op_radius_ok whether the radius fits the picture of the job,     */
+/*           op_names[] the function name of every operation. The filter runs */
+/*           in integers when that gives the same picture, see fixed_kernel.  */
+/******************************************************************************/
+/* Source Code:                                                               */
+const char *op_names[] = { "image_filter", "median_filter", "box_filter", "morph_erode",
+	"morph_dilate", "morph_open", "morph_close" };
+
+int op_by_name(const char *name)
+{
+	if (strcmp(name, "median") == 0)
+		return OP_MEDIAN;
+	if (strcmp(name, "box") == 0)
+		return OP_BOX;
+	if (strcmp(name, "erode") == 0)
+		return OP_ERODE;
+	if (strcmp(name, "dilate") == 0)
+		return OP_DILATE;
+	if (strcmp(name, "open") == 0)
+		return OP_OPEN;
+	if (strcmp(name, "close") == 0)
+		return OP_CLOSE;
+	return -1;
+}
+
+int op_halo(filter_job *job)
+{
+	if (job->op == OP_MEDIAN || job->op == OP_BOX)
+		return job->radius;
+	if (job->op == OP_ERODE || job->op == OP_DILATE)
+		return job->radius_y;
+	if (job->op == OP_OPEN || job->op == OP_CLOSE)
+		return 2 * job->radius_y;
+	return FILTER_SIZE / 2;
+}
+
+int op_halo_x(filter_job *job)
+{
+	if (job->op == OP_MEDIAN || job->op == OP_BOX || job->op == OP_ERODE || job->op == OP_DILATE)
+		return job->radius;
+	if (job->op == OP_OPEN || job->op == OP_CLOSE)
+		return 2 * job->radius;
+	return FILTER_SIZE / 2;
+}
+
+int op_radius_ok(filter_job *job)
+{
+	return job->radius >= 0 && job->radius < job->height && job->radius < job->width &&
+		job->radius_y >= 0 && job->radius_y < job->height;
+}
+
+void apply_op(filter_job *job, picture *pict, int r, int c, picture *new_pict)
+{
+	fixed_filter fk;
+
+	if (job->op == OP_MEDIAN)
+		median_filter(pict, r, c, job->radius, job->maxval, new_pict);
+	else if (job->op == OP_BOX)
+		box_filter(pict, r, c, job->radius, new_pict, job->threads);
+	else if (job->op == OP_ERODE || job->op == OP_DILATE)
+		morph_filter(pict, r, c, job->radius, job->radius_y, job->op == OP_DILATE, new_pict);
+	else if (job->op == OP_OPEN || job->op == OP_CLOSE)
+		morph_open_close(pict, r, c, job->radius, job->radius_y, job->op == OP_CLOSE, new_pict);
+	else if (job->fixed != FIX_NEVER && fixed_kernel(job->flt, job->maxval, &fk) &&
+		(fk.exact || job->fixed == FIX_ALWAYS))
+		image_filter_fixed(pict, r, c, &fk, new_pict);
+	else
+		image_filter(pict, r, c, job->flt, new_pict);
+	return;
+	/* End apply_op function                                                      */
+}
+
+/* sorting networks keeping p[4] of 9 and p[12] of 25 at the median           */
+/* (Paeth 3x3, Devillard 5x5), S(a,b) leaves min in a and max in b             */
+#define MED9_NET(p, S) \
+	S(p[1], p[2]); S(p[4], p[5]); S(p[7], p[8]); S(p[0], p[1]); S(p[3], p[4]); \
+	S(p[6], p[7]); S(p[1], p[2]); S(p[4], p[5]); S(p[7], p[8]); S(p[0], p[3]); \
+	S(p[5], p[8]); S(p[4], p[7]); S(p[3], p[6]); S(p[1], p[4]); S(p[2], p[5]); \
+	S(p[4], p[7]); S(p[4], p[2]); S(p[6], p[4]); S(p[4], p[2])
+
+#define MED25_NET(p, S) \
+	S(p[0], p[1]);   S(p[3], p[4]);   S(p[2], p[4]);   S(p[2], p[3]);   S(p[6], p[7]); \
+	S(p[5], p[7]);   S(p[5], p[6]);   S(p[9], p[10]);  S(p[8], p[10]);  S(p[8], p[9]); \
+	S(p[12], p[13]); S(p[11], p[13]); S(p[11], p[12]); S(p[15], p[16]); S(p[14], p[16]); \
+	S(p[14], p[15]); S(p[18], p[19]); S(p[17], p[19]); S(p[17], p[18]); S(p[21], p[22]); \
+	S(p[20], p[22]); S(p[20], p[21]); S(p[23], p[24]); S(p[2], p[5]);   S(p[3], p[6]); \
+	S(p[0], p[6]);   S(p[0], p[3]);   S(p[4], p[7]);   S(p[1], p[7]);   S(p[1], p[4]); \
+	S(p[11], p[14]); S(p[8], p[14]);  S(p[8], p[11]);  S(p[12], p[15]); S(p[9], p[15]); \
+	S(p[9], p[12]);  S(p[13], p[16]); S(p[10], p[16]); S(p[10], p[13]); S(p[20], p[23]); \
+	S(p[17], p[23]); S(p[17], p[20]); S(p[21], p[24]); S(p[18], p[24]); S(p[18], p[21]); \
+	S(p[19], p[22]); S(p[8], p[17]);  S(p[9], p[18]);  S(p[0], p[18]);  S(p[0], p[9]); \
+	S(p[10], p[19]); S(p[1], p[19]);  S(p[1], p[10]);  S(p[11], p[20]); S(p[2], p[20]); \
+	S(p[2], p[11]);  S(p[12], p[21]); S(p[3], p[21]);  S(p[3], p[12]);  S(p[13], p[22]); \
+	S(p[4], p[22]);  S(p[4], p[13]);  S(p[14], p[23]); S(p[5], p[23]);  S(p[5], p[14]); \
+	S(p[15], p[24]); S(p[6], p[24]);  S(p[6], p[15]);  S(p[7], p[16]);  S(p[7], p[19]); \
+	S(p[13], p[21]); S(p[15], p[23]); S(p[7], p[13]);  S(p[7], p[15]);  S(p[1], p[9]); \
+	S(p[3], p[11]);  S(p[5], p[17]);  S(p[11], p[17]); S(p[9], p[17]);  S(p[4], p[10]); \
+	S(p[6], p[12]);  S(p[7], p[14]);  S(p[4], p[6]);   S(p[4], p[7]);   S(p[12], p[14]); \
+	S(p[10], p[14]); S(p[6], p[7]);   S(p[10], p[12]); S(p[6], p[10]);  S(p[6], p[17]); \
+	S(p[12], p[17]); S(p[7], p[17]);  S(p[7], p[10]);  S(p[12], p[18]); S(p[7], p[12]); \
+	S(p[10], p[18]); S(p[12], p[20]); S(p[10], p[20]); S(p[10], p[12])
+
+#define PIX_SORT(a, b) { if ((a) > (b)) { int t_ = (a); (a) = (b); (b) = t_; } }
+#define VEC_SORT(a, b) { __m128i t_ = (a); (a) = _mm_min_epi16(t_, b); (b) = _mm_max_epi16(t_, b); }
+
+/* Begin median_filter function                                               */
+/******************************************************************************/
+/* Purpose : Median of the (2 radius + 1)^2 window around every pixel. Pixels */
+/*           closer than radius to the edge are copied like image_filter, all */
+/*           of them for radius 0. Radius 1 and 2 use sorting networks on 8   */
+/*           pixels at once (SSE2, 16 bit lanes, if maxval fits them, else one*/
+/*           pixel at a time), larger radius goes to median_hist, or          */
+/*           median_select if maxval is above the 255 bins of median_hist.    */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* pict[][]               int      array address                              */
+/* new_pict[][]           int      array address                              */
+/* r                      int      # of rows                                  */
+/* c                      int      # of column                                */
+/* radius                 int      window radius                              */
+/* maxval                 int      maximum pixel value of the picture         */
+/* n                      int      # of pixels in window                      */
+/* p[]                    int      window of one pixel                        */
+/* v[]                    __m128i  window of 8 pixels                         */
+/******************************************************************************/
+/* Source Code:                                                               */
+void median_filter(picture *pict, int r, int c, int radius, int maxval, picture *new_pict)
+{
+	const int w = 2 * radius + 1, n = w * w, lanes16 = maxval <= 32767;
+	int p[25];
+	__m128i v[25];
+	const int *src;
+	int i, j, m, l, k;
+
+	/*  copy edges                                                                */
+	for (i = 0; i < r; i++)
+		for (j = 0; j < c; j++)
+			if (radius < 1 || i < radius || i >= r - radius || j < radius || j >= c - radius)
+				new_pict->data[i*new_pict->col + j] = pict->data[i*pict->col + j];
+
+	if (radius < 1 || r <= 2 * radius || c <= 2 * radius)
+		return;
+	if (radius > 2)
+	{
+		if (maxval > 255)
+			median_select(pict, r, c, radius, new_pict);
+		else
+			median_hist(pict, r, c, radius, new_pict);
+		return;
+	}
+
+#pragma omp parallel for private(j, m, l, k, p, v, src)
+	for (i = radius; i < r - radius; i++)
+	{
+		/*  8 pixels per step, window element k of all of them in v[k]            */
+		for (j = radius; lanes16 && j + 8 <= c - radius; j += 8)
+		{
+			for (m = 0, k = 0; m < w; m++)
+			{
+				src = pict->data + (i + m - radius)*pict->col + j - radius;
+				for (l = 0; l < w; l++, k++)
+					v[k] = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)(src + l)),
+						_mm_loadu_si128((const __m128i*)(src + l + 4)));
+			}
+			if (radius == 1)
+			{
+				MED9_NET(v, VEC_SORT);
+			}
+			else
+			{
+				MED25_NET(v, VEC_SORT);
+			}
+			k = n / 2;
+			_mm_storeu_si128((__m128i*)(new_pict->data + i*new_pict->col + j),
+				_mm_srai_epi32(_mm_unpacklo_epi16(v[k], v[k]), 16));
+			_mm_storeu_si128((__m128i*)(new_pict->data + i*new_pict->col + j + 4),
+				_mm_srai_epi32(_mm_unpackhi_epi16(v[k], v[k]), 16));
+		}
+
+		/*  rest of the row one pixel at a time                                   */
+		for (; j < c - radius; j++)
+		{
+			for (m = 0, k = 0; m < w; m++)
+				for (l = 0; l < w; l++, k++)
+					p[k] = pict->data[(i + m - radius)*pict->col + j + l - radius];
+			if (radius == 1)
+			{
+				MED9_NET(p, PIX_SORT);
+			}
+			else
+			{
+				MED25_NET(p, PIX_SORT);
+			}
+			new_pict->data[i*new_pict->col + j] = p[n / 2];
+		}
+	}
+
+	return;
+	/* End median_filter function                                                 */
+}
+
+/* Begin median_hist function                                                 */
+/******************************************************************************/
+/* Purpose : Median for any radius in constant time per pixel (Perreault and  */
+/*           Hebert). Every column keeps a 256 bin fine and a 16 bin coarse   */
+/*           histogram of the 2R+1 rows around the current row. The coarse    */
+/*           window histogram slides along the row by adding one column and   */
+/*           removing another (16 bins each) and finds the coarse bin of the  */
+/*           median, only the 16 fine bins of that one are then brought up to */
+/*           the current column, from where they were last used or anew.      */
+/*           Every thread does one strip of rows with its own column          */
+/*           histograms. Pixel values are taken as 0..255.                    */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* hist, coarse           unsigned short *  256 and 16 bins per column        */
+/* kfine[], kcoarse[]     int      histogram of the window                    */
+/* luc[]                  int      column the fine bins of a coarse bin are   */
+/*                                 up to date for, -1 = none                  */
+/* lo, hi                 int      strip of rows of the thread                */
+/* half                   int      median is the first value with more than   */
+/*                                 half pixels at or below it                 */
+/******************************************************************************/
+/* Source Code:                                                               */
+#define PIX_BIN(x) ((x) < 0 ? 0 : (x) > 255 ? 255 : (x))
+
+void median_hist(picture *pict, int r, int c, int radius, picture *new_pict)
+{
+	const int w = 2 * radius + 1, half = w * w / 2;
+
+#pragma omp parallel
+	{
+		unsigned short *hist, *coarse;
+		int kfine[256], kcoarse[16], luc[16];
+		int i, j, m, b, x, v, sum, lo, hi, nt = 1, t = 0;
+
+#ifdef _OPENMP
+		nt = omp_get_num_threads();
+		t = omp_get_thread_num();
+#endif
+		lo = radius + (int)((long long)(r - 2 * radius) * t / nt);
+		hi = radius + (int)((long long)(r - 2 * radius) * (t + 1) / nt);
+		hist = (unsigned short*)calloc((size_t)c * (256 + 16), sizeof(unsigned short));
+		if (hist == NULL)
+			printf("creating median histogram failed\n");
+		else if (lo < hi)
+		{
+			coarse = hist + (size_t)c * 256;
+
+			/*  column histograms of the 2R rows above row lo + R                    */
+			for (i = lo - radius; i < lo + radius; i++)
+				for (j = 0; j < c; j++)
+				{
+					v = PIX_BIN(pict->data[i*pict->col + j]);
+					hist[j * 256 + v]++;
+					coarse[j * 16 + v / 16]++;
+				}
+
+			for (i = lo; i < hi; i++)
+			{
+				/*  move every column histogram down one row                          */
+				for (j = 0; j < c; j++)
+				{
+					if (i > lo)
+					{
+						v = PIX_BIN(pict->data[(i - radius - 1)*pict->col + j]);
+						hist[j * 256 + v]--;
+						coarse[j * 16 + v / 16]--;
+					}
+					v = PIX_BIN(pict->data[(i + radius)*pict->col + j]);
+					hist[j * 256 + v]++;
+					coarse[j * 16 + v / 16]++;
+				}
+
+				/*  coarse window histogram of the first pixel, no fine bins yet      */
+				memset(kcoarse, 0, sizeof(kcoarse));
+				for (m = 0; m < w; m++)
+					for (b = 0; b < 16; b++)
+						kcoarse[b] += coarse[m * 16 + b];
+				for (b = 0; b < 16; b++)
+					luc[b] = -1;
+
+				for (j = radius; j < c - radius; j++)
+				{
+					if (j > radius)
+						for (b = 0; b < 16; b++)
+							kcoarse[b] += coarse[(j + radius) * 16 + b] - coarse[(j - radius - 1) * 16 + b];
+
+					/*  coarse bin holding the median                                     */
+					for (b = 0, sum = 0; sum + kcoarse[b] <= half; b++)
+						sum += kcoarse[b];
+
+					/*  its fine bins at column j, anew if that is cheaper               */
+					if (luc[b] < 0 || 2 * (j - luc[b]) > w)
+					{
+						memset(kfine + 16 * b, 0, 16 * sizeof(int));
+						for (m = j - radius; m <= j + radius; m++)
+							for (x = 0; x < 16; x++)
+								kfine[16 * b + x] += hist[m * 256 + 16 * b + x];
+					}
+					else
+						for (m = luc[b] + 1; m <= j; m++)
+							for (x = 0; x < 16; x++)
+								kfine[16 * b + x] += hist[(m + radius) * 256 + 16 * b + x] -
+									hist[(m - radius - 1) * 256 + 16 * b + x];
+					luc[b] = j;
+
+					for (x = 16 * b; sum + kfine[x] <= half; x++)
+						sum += kfine[x];
+					new_pict->data[i*new_pict->col + j] = x;
+				}
+			}
+		}
+		free(hist);
+	}
+	return;
+	/* End median_hist function                                                   */
+}
+
+/* Begin median_select function                                               */
+/******************************************************************************/
+/* Purpose : Median for any radius and any pixel value, for pictures above    */
+/*           255 that median_hist can not bin. The window of every pixel is   */
+/*           copied and its middle element found with Wirth's selection.      */
+/*           Rows are spread over the threads, each with its own window.      */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* win                    int *    window of one pixel, per thread            */
+/* lo, hi                 int      part of win still holding the median       */
+/* a, b, x                int      partition of win[lo..hi] around x          */
+/******************************************************************************/
+/* Source Code:                                                               */
+void median_select(picture *pict, int r, int c, int radius, picture *new_pict)
+{
+	const int w = 2 * radius + 1, n = w * w;
+	int i;
+
+#pragma omp parallel
+	{
+		int *win = (int*)malloc(n * sizeof(int));
+		int j, m, l, k, lo, hi, a, b, x, t;
+
+		if (win == NULL)
+			printf("creating median window failed\n");
+#pragma omp for
+		for (i = radius; i < r - radius; i++)
+			for (j = radius; j < c - radius && win != NULL; j++)
+			{
+				for (m = 0, k = 0; m < w; m++)
+					for (l = 0; l < w; l++, k++)
+						win[k] = pict->data[(i + m - radius)*pict->col + j + l - radius];
+
+				for (lo = 0, hi = n - 1; lo < hi;)
+				{
+					x = win[n / 2];
+					a = lo;
+					b = hi;
+					do
+					{
+						while (win[a] < x)
+							a++;
+						while (x < win[b])
+							b--;
+						if (a <= b)
+						{
+							t = win[a];
+							win[a] = win[b];
+							win[b] = t;
+							a++;
+							b--;
+						}
+					} while (a <= b);
+					if (b < n / 2)
+						lo = a;
+					if (n / 2 < a)
+						hi = b;
+				}
+				new_pict->data[i*new_pict->col + j] = win[n / 2];
+			}
+		free(win);
+	}
+	return;
+	/* End median_select function                                                 */
+}
+
+/* Begin integral_image function                                              */
+/******************************************************************************/
+/* Purpose : Summed area table of the picture, sat[(i+1)*(c+1) + j+1] is the  */
+/*           sum of rows 0..i and columns 0..j, row 0 and column 0 of sat are */
+/*           zero. 64 bit sums so large pictures do not overflow.            */
+/*           The rows are split in one band per thread, every band is summed  */
+/*           on its own and then gets the carry (last row sums of all bands   */
+/*           above it) added. Across MPI tasks the bands carry R rows of      */
+/*           halo instead, so every task sums its own table.                  */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* sat                    long long *  (r+1) x (c+1) table                    */
+/* threads                int      # of threads (bands)                       */
+/* carry                  long long *  carry row of every band                */
+/* s                      long long    running sum along the row             */
+/******************************************************************************/
+/* Source Code:                                                               */
+void integral_image(picture *pict, int r, int c, long long *sat, int threads)
+{
+	const int w = c + 1;
+	int nb = threads < 1 ? 1 : threads < r ? threads : r;
+	long long *carry;
+	int t;
+
+	memset(sat, 0, w * sizeof(long long));
+	carry = (long long*)calloc((size_t)nb * w, sizeof(long long));
+	if (carry == NULL)
+	{
+		printf("creating integral carry failed\n");
+		return;
+	}
+
+	/*  sum every band on its own                                             */
+#pragma omp parallel for num_threads(nb)
+	for (t = 0; t < nb; t++)
+	{
+		int lo = (int)((long long)r * t / nb), hi = (int)((long long)r * (t + 1) / nb);
+		int i, j;
+		long long s;
+
+		for (i = lo; i < hi; i++)
+		{
+			long long *row = sat + (size_t)(i + 1) * w;
+			row[0] = 0;
+			for (j = 0, s = 0; j < c; j++)
+			{
+				s += pict->data[i*pict->col + j];
+				row[j + 1] = (i > lo ? row[j + 1 - w] : 0) + s;
+			}
+		}
+	}
+
+	/*  carry of band t is the sum of the last rows of bands 0..t-1           */
+	for (t = 1; t < nb; t++)
+	{
+		int last = (int)((long long)r * t / nb);
+		int j;
+
+		for (j = 0; j < w; j++)
+			carry[(size_t)t * w + j] = carry[(size_t)(t - 1) * w + j] + sat[(size_t)last * w + j];
+	}
+
+#pragma omp parallel for num_threads(nb)
+	for (t = 1; t < nb; t++)
+	{
+		int lo = (int)((long long)r * t / nb), hi = (int)((long long)r * (t + 1) / nb);
+		int i, j;
+
+		for (i = lo; i < hi; i++)
+			for (j = 0; j < w; j++)
+				sat[(size_t)(i + 1) * w + j] += carry[(size_t)t * w + j];
+	}
+
+	free(carry);
+	return;
+	/* End integral_image function                                                */
+}
+
+/* Begin box_filter function                                                  */
+/******************************************************************************/
+/* Purpose : Mean of the (2 radius + 1)^2 window around every pixel, four     */
+/*           lookups in the summed area table per pixel for any radius.       */
+/*           Pixels closer than radius to the edge are copied, all of them    */
+/*           for radius 0.                                                    */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* sat                    long long *  summed area table of the band          */
+/* n                      int      # of pixels in window                      */
+/******************************************************************************/
+/* Source Code:                                                               */
+void box_filter(picture *pict, int r, int c, int radius, picture *new_pict, int threads)
+{
+	const int w = c + 1, n = (2 * radius + 1) * (2 * radius + 1);
+	long long *sat;
+	int i, j;
+
+	/*  copy edges                                                                */
+	for (i = 0; i < r; i++)
+		for (j = 0; j < c; j++)
+			if (radius < 1 || i < radius || i >= r - radius || j < radius || j >= c - radius)
+				new_pict->data[i*new_pict->col + j] = pict->data[i*pict->col + j];
+
+	if (radius < 1 || r <= 2 * radius || c <= 2 * radius)
+		return;
+
+	sat = (long long*)malloc((size_t)(r + 1) * w * sizeof(long long));
+	if (sat == NULL)
+	{
+		printf("creating integral image failed\n");
+		return;
+	}
+	integral_image(pict, r, c, sat, threads);
+
+#pragma omp parallel for num_threads(threads < 1 ? 1 : threads)
+	for (i = radius; i < r - radius; i++)
+	{
+		const long long *lo = sat + (size_t)(i - radius) * w;
+		const long long *hi = sat + (size_t)(i + radius + 1) * w;
+		int k;
+
+		for (k = radius; k < c - radius; k++)
+			new_pict->data[i*new_pict->col + k] = (int)((hi[k + radius + 1] - lo[k + radius + 1] -
+				hi[k - radius] + lo[k - radius]) / n);
+	}
+
+	free(sat);
+	return;
+	/* End box_filter function                                                    */
+}
+
+/* Begin filter_pyramid function                                              */
+/******************************************************************************/
+/* Purpose : Build a Gaussian pyramid of job->levels levels from the picture  */
+/*           and filter every level with the job. All levels of the pyramid  */
+/*           and of its filtered copy are views in one pooled allocation.     */
+/*           Level 0 goes to newpict (written to job->out by main), level k   */
+/*           is written to <out>_k.pgm. Levels are built one after the other, */
+/*           each by all threads over rows, level 0 is filtered by all        */
+/*           threads and the smaller levels at the same time, one per thread. */
+/*           Root only.                                                       */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* all                    picture  one allocation for every level, rows as    */
+/*                                 wide as level 0, levels then filtered ones */
+/* rows                   int      rows of all holding one copy of the levels */
+/* in[], out[]            picture  levels, filtered levels (views in all)     */
+/* row[], col[]           int      height and width of every level            */
+/* fname[]                char     file name of level k                       */
+/******************************************************************************/
+/* Source Code:                                                               */
+void filter_pyramid(picture_pool *pool, filter_job *job, picture *pict, picture *newpict)
+{
+	const int pad = PICT_ALIGN / sizeof(int);
+	picture all, in[PYR_MAX], out[PYR_MAX];
+	int row[PYR_MAX], col[PYR_MAX];
+	int i, k, levels, rows, total = 0;
+	char fname[JOB_PATH + 8], *dot;
+
+	/* size and place of every level */
+	row[0] = job->height;
+	col[0] = job->width;
+	for (levels = 1; levels < job->levels && levels < PYR_MAX &&
+		row[levels - 1] >= 2 * PYR_MIN && col[levels - 1] >= 2 * PYR_MIN; levels++)
+	{
+		row[levels] = (row[levels - 1] + 1) / 2;
+		col[levels] = (col[levels - 1] + 1) / 2;
+	}
+	for (k = 0; k < levels; k++)
+		total += row[k] * ((col[k] + pad - 1) / pad * pad);
+	/* many rows, so first_touch spreads the pages over the threads */
+	rows = (total + col[0] - 1) / col[0];
+	if (PicturePoolNew(pool, &all, 2 * rows, col[0], 0) != 1)
+	{
+		printf("creating pyramid matrix failed\n");
+		return;
+	}
+	for (k = 0, total = 0; k < levels; k++)
+	{
+		in[k].row = out[k].row = row[k];
+		in[k].col = out[k].col = (col[k] + pad - 1) / pad * pad;
+		in[k].data = all.data + total;
+		out[k].data = all.data + (size_t)rows * all.col + total;
+		total += row[k] * in[k].col;
+	}
+
+	/* build the levels */
+	for (i = 0; i < row[0]; i++)
+		memcpy(in[0].data + i * in[0].col, pict->data + i * pict->col, col[0] * sizeof(int));
+	for (k = 1; k < levels; k++)
+		pyramid_down(&in[k - 1], row[k - 1], col[k - 1], &in[k]);
+
+	/* filter them, the small levels together */
+	apply_op(job, &in[0], row[0], col[0], &out[0]);
+#pragma omp parallel for schedule(dynamic, 1)
+	for (k = 1; k < levels; k++)
+		apply_op(job, &in[k], row[k], col[k], &out[k]);
+
+	for (i = 0; i < row[0]; i++)
+		memcpy(newpict->data + i * newpict->col, out[0].data + i * out[0].col, col[0] * sizeof(int));
+	for (k = 1; k < levels; k++)
+	{
+		strcpy(fname, job->out);
+		dot = strrchr(fname, '.');
+		if (dot != NULL && strchr(dot, '/') == NULL && strchr(dot, '\\') == NULL)
+			*dot = '\0';
+		sprintf(fname + strlen(fname), "_%d.pgm", k);
+		write_pict(fname, &out[k], row[k], col[k], job->maxval);
+	}
+	printf("pyramid of %d levels, %dx%d to %dx%d\n", levels, col[0], row[0],
+		col[levels - 1], row[levels - 1]);
+
+	PictureRelease(pool, &all);
+	return;
+	/* End filter_pyramid function                                                */
+}
+
+/* Begin pyramid_down function                                                */
+/******************************************************************************/
+/* Purpose : Next level of the pyramid, blur with the 5x5 binomial filter     */
+/*           (1 4 6 4 1)/16 both ways and keep every second row and column,  */
+/*           in one pass: every row of dst sums 5 rows of src into a row      */
+/*           buffer, then 5 columns of it. Edges are repeated.                */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* src, dst               picture *  level k (r x c), level k + 1             */
+/* v                      int *    vertical sums of a row, 2 extra each side  */
+/* s[5]                   int *    5 rows of src around row 2i                */
+/******************************************************************************/
+/* Source Code:                                                               */
+void pyramid_down(picture *src, int r, int c, picture *dst)
+{
+	const int r2 = (r + 1) / 2, c2 = (c + 1) / 2;
+	int i, j, k, x;
+
+#pragma omp parallel private(i, j, k, x)
+	{
+		int *v = (int*)malloc((c + 5) * sizeof(int)) + 2;
+		const int *s[5];
+
+#pragma omp for schedule(static)
+		for (i = 0; i < r2; i++)
+		{
+			for (k = 0; k < 5; k++)
+			{
+				x = 2 * i + k - 2;
+				x = x < 0 ? 0 : x >= r ? r - 1 : x;
+				s[k] = src->data + x * src->col;
+			}
+			for (j = 0; j < c; j++)
+				v[j] = s[0][j] + 4 * (s[1][j] + s[3][j]) + 6 * s[2][j] + s[4][j];
+			v[-2] = v[-1] = v[0];
+			v[c] = v[c + 1] = v[c + 2] = v[c - 1];
+
+			for (j = 0; j < c2; j++)
+			{
+				x = 2 * j;
+				dst->data[i * dst->col + j] = (v[x - 2] + 4 * (v[x - 1] + v[x + 1]) + 6 * v[x] +
+					v[x + 2] + 128) >> 8;
+			}
+		}
+		free(v - 2);
+	}
+	return;
+	/* End pyramid_down function                                                  */
+}
+
+/* Begin tiled picture functions                                              */
+/******************************************************************************/
+/* Purpose : Tiled picture file (.imt) for pictures larger than IM_SIZE, of   */
+/*           which only a region of interest is filtered. The file is a       */
+/*           tiled_header, the file offset of every tile (long long, row by   */
+/*           row of tiles) and the tiles, tile x tile pixels of one byte,     */
+/*           padded with 0 at the right and bottom edge.                      */
+/*           tiled_convert  PGM to tiled file, a row of tiles at a time       */
+/*           tiled_write    picture to tiled file                             */
+/*           tiled_access   copy a region between the file and a picture,    */
+/*                          mapping only the tiles covering it                */
+/*           read_input     read job->in (PGM, or region + halo of .imt)      */
+/*           write_output   write job->out (PGM, or region back into .imt)    */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* h                      tiled_header  size of picture and tiles             */
+/* strip                  picture  one row of tiles of the picture            */
+/* tile                   unsigned char *  pixels of a tile                   */
+/* x, y, w, h             int      region of the file                         */
+/* px, py                 int      place of the region in pict                */
+/* at[4]                  int      region of the picture in the file and its  */
+/*                                 place in pict (x, y, left, top)            */
+/******************************************************************************/
+/* Source Code:                                                               */
+FILE *tiled_create(const char *fname, int width, int height, int tile)
+{
+	tiled_header h;
+	long long offset;
+	FILE *out;
+	int i;
 
-	if (taskid == 0)
+	out = fopen(fname, "wb");
+	if (out == NULL)
 	{
-		/* actual height and width of pict */
-		int width, height; 
-
-		/* create main matrix to store picture*/
-		picture pict;
-		picture newpict;
-		if (PictureNew(&newpict, IM_SIZE, IM_SIZE) != 1)
-			printf("creating main new picture matrix failed\n");
-		if (PictureNew(&pict, IM_SIZE, IM_SIZE) != 1)
-			printf("creating main ori picture matrix failed\n"); 
+		printf("Error writing %s\n", fname);
+		return NULL;
+	}
 
-		/* create local matrix to worked by root */
-		picture local_pict;
-		picture local_newpict;
-		if (PictureNew(&local_newpict, aveheight+1, IM_SIZE) != 1)
-			printf("creating local new picture matrix at workder %d failed\n", taskid); 
-		if (PictureNew(&local_pict, aveheight+1, IM_SIZE) != 1)
-			printf("creating local ori picture matrix at workder %d failed\n", taskid); 
-
-		/* read picture file */
-		read_pict(&pict, &height, &width);
-		
-		/* scatter file for other worker */
-		MPI_Scatter(pict.data, aveheight*pict.col, MPI_INT, local_pict.data, 
-					aveheight*local_pict.col, MPI_INT, 0, MPI_COMM_WORLD);
-		
-		/* send N-1 & N+1 part to other worker and self*/
-		/* N-1 and N+1 for worker 1 */
-		MPI_Send(pict.data + (1 * aveheight - 1) * pict.col, pict.col, MPI_INT, 1, 0, MPI_COMM_WORLD);
-		MPI_Send(pict.data + 2 * aveheight * pict.col, pict.col, MPI_INT, 1, 0, MPI_COMM_WORLD);
-
-		/* N-1 and N+1 for worker 2 */
-		MPI_Send(pict.data + (2 * aveheight - 1) * pict.col, pict.col, MPI_INT, 2, 0, MPI_COMM_WORLD);
-		MPI_Send(pict.data + 3 * aveheight * pict.col, pict.col, MPI_INT, 2, 0, MPI_COMM_WORLD);
-
-		/* N-1 for worker 3 */
-		MPI_Send(pict.data + (3 * aveheight - 1) * pict.col, pict.col, MPI_INT, 3, 0, MPI_COMM_WORLD);
-
-		/* N+1 for worker 0*/
-		for (i = 0;i < IM_SIZE;i++)
-			local_pict.data[aveheight*pict.col + i] = pict.data[aveheight*pict.col + i];
-		
-		/* do local filtering for image */
-		image_filter(&local_pict, local_pict.row, local_newpict.col, flt, &local_newpict);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TILED_MAGIC, 4);
+	h.width = width;
+	h.height = height;
+	h.tile = tile;
+	h.tiles_x = (width + tile - 1) / tile;
+	h.tiles_y = (height + tile - 1) / tile;
+	h.depth = 1;
+	fwrite(&h, sizeof(h), 1, out);
+
+	/* tiles follow the index in the same order */
+	offset = sizeof(h) + (long long)h.tiles_x * h.tiles_y * sizeof(long long);
+	for (i = 0; i < h.tiles_x * h.tiles_y; i++, offset += (long long)tile * tile)
+		fwrite(&offset, sizeof(offset), 1, out);
+	return out;
+}
 
-		/* gather back result to root */
-		MPI_Gather(local_newpict.data, aveheight*local_newpict.col, MPI_INT, 
-			newpict.data, aveheight*local_newpict.col, MPI_INT, 0, MPI_COMM_WORLD );
-		
-		/* print the image */
-		write_pict(&newpict, height, width);
+void tiled_put_strip(FILE *out, picture *strip, int rows, int width, int tile)
+{
+	unsigned char *t = (unsigned char*)calloc(tile * tile, 1);
+	int i, j, x, v;
 
-		/* Dont forget to free memory used :) */
-		free(pict.data);
-		pict.data = NULL;
-		free(newpict.data);
-		newpict.data = NULL;
-		free(local_pict.data);
-		local_pict.data = NULL;
-		free(local_newpict.data);
-		local_newpict.data = NULL;
-		printf_s("time taken, %d milliseconds\n", GetTickCount() - dwStart);
+	for (x = 0; x < width; x += tile)
+	{
+		for (i = 0; i < tile; i++)
+			for (j = 0; j < tile; j++)
+			{
+				v = i < rows && x + j < width ? strip->data[i*strip->col + x + j] : 0;
+				t[i*tile + j] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+			}
+		fwrite(t, 1, tile * tile, out);
 	}
+	free(t);
+	return;
+}
 
+int tiled_convert(const char *pgm, const char *fname, int tile)
+{
+	picture strip;
+	char line[200];
+	int i, j, r, c, max, rows;
+	FILE *in, *out;
 
-	else if (taskid == 1)
+	in = fopen(pgm, "r");
+	if (in == NULL)
 	{
-		/* create local matrix to worked by worker 1 */
-		picture local_pict;
-		picture local_newpict;
-		if (PictureNew(&local_newpict, aveheight + 2, IM_SIZE) != 1)
-			printf("creating local new picture matrix at workder %d failed\n", taskid); 
-		if (PictureNew(&local_pict, aveheight + 2, IM_SIZE) != 1)
-			printf("creating local ori picture matrix at workder %d failed\n", taskid); 
-
-		/* receive scatter data */
-		MPI_Scatter(NULL, aveheight*local_pict.col, MPI_INT, local_pict.data + 1 * local_pict.col,
-			aveheight*local_pict.col, MPI_INT, 0, MPI_COMM_WORLD);
-		
-		/* receive N-1 and N+1 data */
-		MPI_Recv(local_pict.data, local_pict.col, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
-		MPI_Recv(local_pict.data + (aveheight + 1)*local_pict.col, local_pict.col, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
-
-		/* do local filtering for image */
-		image_filter(&local_pict, local_pict.row, local_newpict.col, flt, &local_newpict);
+		printf("Error reading %s\n", pgm);
+		return 0;
+	}
+	fgets(line, 199, in); // get PGM Type
+	if (strncmp(line, "P2", 2) == 0)
+		fgets(line, 199, in); // get comment
+	else
+		line[0] = '\0';
+	if (line[0] == '\0' || fscanf(in, "%d %d %d", &c, &r, &max) != 3 || r < 1 || c < 1)
+	{
+		printf("Cannot process %s, only P2 type\n", pgm);
+		fclose(in);
+		return 0;
+	}
 
-		/* gather back result to root */
-		MPI_Gather(local_newpict.data + 1 * local_newpict.col, aveheight*local_newpict.col, MPI_INT,
-			NULL, aveheight*local_newpict.col, MPI_INT, 0, MPI_COMM_WORLD);
-		
-		//write_pict(&local_newpict, aveheight+2, IM_SIZE);
-		
-		/* Dont forget to free memory used */
-		free(local_pict.data);
-		local_pict.data = NULL;
-		free(local_newpict.data);
-		local_newpict.data = NULL;
-	}
-
-	else if (taskid == 2)
-	{
-		/* create local matrix to worked by worker 2 */
-		picture local_pict;
-		picture local_newpict;
-		if (PictureNew(&local_newpict, aveheight + 2, IM_SIZE) != 1)
-			printf("creating local new picture matrix at workder %d failed\n", taskid);
-		if (PictureNew(&local_pict, aveheight + 2, IM_SIZE) != 1)
-			printf("creating local ori picture matrix at workder %d failed\n", taskid); 
+	/* one row of tiles in memory at a time */
+	if (PictureNew(&strip, tile, c) != 1 || (out = tiled_create(fname, c, r, tile)) == NULL)
+	{
+		free(strip.data);
+		fclose(in);
+		return 0;
+	}
+	for (i = 0; i < r; i += tile)
+	{
+		rows = r - i < tile ? r - i : tile;
+		for (j = 0; j < rows * c; j++)
+			fscanf(in, "%d", &strip.data[j]);
+		tiled_put_strip(out, &strip, rows, c, tile);
+	}
 
-		/* receive scatter data */
-		MPI_Scatter(NULL, aveheight*local_pict.col, MPI_INT, local_pict.data + 1 * local_pict.col,
-			aveheight*local_pict.col, MPI_INT, 0, MPI_COMM_WORLD);
+	fclose(out);
+	fclose(in);
+	free(strip.data);
+	printf("%s: %d x %d in tiles of %d to %s\n", pgm, c, r, tile, fname);
+	return 1;
+}
 
-		/* receive N-1 and N+1 data */
-		MPI_Recv(local_pict.data, local_pict.col, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
-		MPI_Recv(local_pict.data + (aveheight + 1)*local_pict.col, local_pict.col, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
+void tiled_write(const char *fname, picture *pict, int r, int c, int tile)
+{
+	picture strip;
+	int i;
+	FILE *out;
 
-		/* do local filtering for image */
-		image_filter(&local_pict, local_pict.row, local_newpict.col, flt, &local_newpict);
+	out = tiled_create(fname, c, r, tile);
+	if (out == NULL)
+		return;
+	strip.row = tile;
+	strip.col = pict->col;
+	for (i = 0; i < r; i += tile)
+	{
+		strip.data = pict->data + i * pict->col;
+		tiled_put_strip(out, &strip, r - i < tile ? r - i : tile, c, tile);
+	}
+	fclose(out);
+	return;
+}
 
-		/* gather back result to root */
-		MPI_Gather(local_newpict.data + 1 * local_newpict.col, aveheight*local_newpict.col, MPI_INT,
-			NULL, aveheight*local_newpict.col, MPI_INT, 0, MPI_COMM_WORLD);
+char *tiled_view(HANDLE map, long long offset, long long len, int write, void **base)
+{
+	SYSTEM_INFO si;
+	long long start;
+
+	/* views start at a multiple of the allocation granularity */
+	GetSystemInfo(&si);
+	start = offset - offset % si.dwAllocationGranularity;
+	*base = MapViewOfFile(map, write ? FILE_MAP_WRITE : FILE_MAP_READ, (DWORD)(start >> 32),
+		(DWORD)(start & 0xffffffff), (SIZE_T)(offset - start + len));
+	return *base == NULL ? NULL : (char*)*base + (offset - start);
+}
 
-		//write_pict(&local_newpict, aveheight + 2, IM_SIZE);
-		
-		/* Dont forget to free memory used */
-		free(local_pict.data);
-		local_pict.data = NULL;
-		free(local_newpict.data);
-		local_newpict.data = NULL;
+int tiled_access(const char *fname, picture *pict, int px, int py, int x, int y, int w, int h,
+	int write, tiled_header *info)
+{
+	HANDLE file, map;
+	tiled_header hd;
+	long long *offset, lo, hi;
+	unsigned char *tile;
+	char *data;
+	void *base, *index_base, *data_base;
+	int tx, ty, i, j, ok = 1;
+
+	file = CreateFileA(fname, GENERIC_READ | (write ? GENERIC_WRITE : 0), FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		printf("Error reading %s\n", fname);
+		return 0;
 	}
+	map = CreateFileMappingA(file, NULL, write ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+	data = map == NULL ? NULL : tiled_view(map, 0, sizeof(hd), 0, &base);
+	if (data == NULL)
+	{
+		printf("Cannot map %s\n", fname);
+		if (map != NULL)
+			CloseHandle(map);
+		CloseHandle(file);
+		return 0;
+	}
+	memcpy(&hd, data, sizeof(hd));
+	UnmapViewOfFile(base);
+	if (info != NULL)
+		*info = hd;
 
-
-	else if (taskid == 3)
+	if (memcmp(hd.magic, TILED_MAGIC, 4) != 0 || hd.depth != 1 || hd.tile < 1)
 	{
-		/* create local matrix to worked by worker 3 */
-		picture local_pict;
-		picture local_newpict;
-		if (PictureNew(&local_newpict, aveheight + 1, IM_SIZE) != 1)
-			printf("creating local new picture matrix at workder %d failed\n", taskid); 
-		if (PictureNew(&local_pict, aveheight + 1, IM_SIZE) != 1)
-			printf("creating local ori picture matrix at workder %d failed\n", taskid);
+		printf("%s is not a tiled picture\n", fname);
+		ok = 0;
+	}
+	else if (w > 0 && (x < 0 || y < 0 || x + w > hd.width || y + h > hd.height))
+	{
+		printf("Region %d x %d at %d, %d is outside %s\n", w, h, x, y, fname);
+		ok = 0;
+	}
 
-		/* receive scatter data */
-		MPI_Scatter(NULL, aveheight*local_pict.col, MPI_INT, local_pict.data + 1 * local_pict.col,
-					aveheight*local_pict.col, MPI_INT, 0, MPI_COMM_WORLD);
+	/* one view of the index and one of the tiles for every row of tiles */
+	for (ty = y / hd.tile; ok && w > 0 && ty <= (y + h - 1) / hd.tile; ty++)
+	{
+		const int tx0 = x / hd.tile, tx1 = (x + w - 1) / hd.tile;
+		const int y0 = ty * hd.tile > y ? ty * hd.tile : y;
+		const int y1 = (ty + 1) * hd.tile < y + h ? (ty + 1) * hd.tile : y + h;
 
-		/* receive N-1 data */
-		MPI_Recv(local_pict.data, local_pict.col, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
-	
-		/* do local filtering for image */
-		image_filter(&local_pict, local_pict.row, local_newpict.col, flt, &local_newpict);
+		offset = (long long*)tiled_view(map, sizeof(hd) + ((long long)ty * hd.tiles_x + tx0) * sizeof(long long),
+			(tx1 - tx0 + 1) * sizeof(long long), 0, &index_base);
+		if (offset == NULL)
+		{
+			ok = 0;
+			break;
+		}
+		lo = hi = offset[0];
+		for (tx = tx0; tx <= tx1; tx++)
+		{
+			lo = offset[tx - tx0] < lo ? offset[tx - tx0] : lo;
+			hi = offset[tx - tx0] > hi ? offset[tx - tx0] : hi;
+		}
+		data = tiled_view(map, lo, hi - lo + (long long)hd.tile * hd.tile, write, &data_base);
+		if (data == NULL)
+		{
+			UnmapViewOfFile(index_base);
+			ok = 0;
+			break;
+		}
 
-		/* gather back result to root */
-		MPI_Gather(local_newpict.data + 1 * local_pict.col, aveheight*local_newpict.col, MPI_INT,
-			NULL, aveheight*local_newpict.col, MPI_INT, 0, MPI_COMM_WORLD);
-		
-		//write_pict(&local_pict, aveheight+1, IM_SIZE);
-		
-		/* Dont forget to free memory used */
-		free(local_pict.data);
-		local_pict.data = NULL;
-		free(local_newpict.data);
-		local_newpict.data = NULL;
+		for (tx = tx0; tx <= tx1; tx++)
+		{
+			const int x0 = tx * hd.tile > x ? tx * hd.tile : x;
+			const int x1 = (tx + 1) * hd.tile < x + w ? (tx + 1) * hd.tile : x + w;
+			tile = (unsigned char*)data + (offset[tx - tx0] - lo);
+
+			for (i = y0; i < y1; i++)
+			{
+				unsigned char *t = tile + (i - ty * hd.tile) * hd.tile - tx * hd.tile;
+				int *p = pict->data + (py + i - y) * pict->col + px - x;
+				if (write)
+					for (j = x0; j < x1; j++)
+						t[j] = (unsigned char)(p[j] < 0 ? 0 : p[j] > 255 ? 255 : p[j]);
+				else
+					for (j = x0; j < x1; j++)
+						p[j] = t[j];
+			}
+		}
+		UnmapViewOfFile(data_base);
+		UnmapViewOfFile(index_base);
 	}
+	if (!ok && w > 0)
+		printf("Error accessing tiles of %s\n", fname);
 
-	MPI_Finalize();
-
+	CloseHandle(map);
+	CloseHandle(file);
+	return ok;
+}
 
-	return(0);
-	/* End Main Function                                                          */
+int is_tiled(const char *fname)
+{
+	size_t n = strlen(fname);
+	return n > 4 && strcmp(fname + n - 4, ".imt") == 0;
 }
 
-int PictureNew(picture *m, int x, int y)
+int read_input(filter_job *job, picture *pict, int *roi, int *at)
 {
-	m->row = x;
-	m->col = y;
-	m->data = (int*)calloc(m->row*m->col, sizeof(int));
+	tiled_header hd;
+	int halo = op_halo(job), halo_x = op_halo_x(job);
 
-	if (m->data)
-		return 1;
-	else
+	if (!is_tiled(job->in))
+	{
+		at[0] = at[1] = at[2] = at[3] = 0;
+		return read_pict(job->in, pict, &job->height, &job->width, &job->maxval);
+	}
+	job->maxval = 255;
+
+	/* the region with the halo its filter needs, cut at the picture edges */
+	if (tiled_access(job->in, pict, 0, 0, 0, 0, 0, 0, 0, &hd) != 1)
+		return 0;
+	if (roi[2] < 1 || roi[3] < 1)
+	{
+		roi[0] = roi[1] = 0;
+		roi[2] = hd.width;
+		roi[3] = hd.height;
+	}
+	at[0] = roi[0] - halo_x < 0 ? 0 : roi[0] - halo_x;
+	at[1] = roi[1] - halo < 0 ? 0 : roi[1] - halo;
+	job->width = (roi[0] + roi[2] + halo_x > hd.width ? hd.width : roi[0] + roi[2] + halo_x) - at[0];
+	job->height = (roi[1] + roi[3] + halo > hd.height ? hd.height : roi[1] + roi[3] + halo) - at[1];
+	at[2] = roi[0] - at[0];
+	at[3] = roi[1] - at[1];
+	if (job->width > pict->col || job->height > pict->row)
+	{
+		printf("Cannot process %d x %d region, maximum is %d x %d\n", job->width, job->height,
+			pict->col, pict->row);
 		return 0;
+	}
+	return tiled_access(job->in, pict, 0, 0, at[0], at[1], job->width, job->height, 0, NULL);
 }
 
+void write_output(filter_job *job, picture *newpict, int *roi, int *at)
+{
+	picture view;
+	FILE *test;
 
-/* Begin read_pict function                                                   */
+	if (!is_tiled(job->in))
+	{
+		if (is_tiled(job->out))
+			tiled_write(job->out, newpict, job->height, job->width, TILED_SIZE);
+		else
+			write_pict(job->out, newpict, job->height, job->width, job->maxval);
+		return;
+	}
+
+	/* only the region, without its halo */
+	view.row = roi[3];
+	view.col = newpict->col;
+	view.data = newpict->data + at[3] * newpict->col + at[2];
+	if (!is_tiled(job->out))
+		write_pict(job->out, &view, roi[3], roi[2], job->maxval);
+	else
+	{
+		/* into the existing tiled output, a copy of the input the first time */
+		test = fopen(job->out, "rb");
+		if (test != NULL)
+			fclose(test);
+		else if (!CopyFileA(job->in, job->out, TRUE))
+		{
+			printf("Error writing %s\n", job->out);
+			return;
+		}
+		tiled_access(job->out, &view, 0, 0, roi[0], roi[1], roi[2], roi[3], 1, NULL);
+	}
+	return;
+	/* End tiled picture functions                                                */
+}
+
+/* Begin morph_filter function                                                */
 /******************************************************************************/
-/* Purpose : This function reads the image from original.pgm                  */
+/* Purpose : Grayscale erode (min) or dilate (max) over a (2 rx + 1) x        */
+/*           (2 ry + 1) rectangle, van Herk / Gil-Werman: the lines are cut   */
+/*           in blocks of the window size, g is the running min/max from the  */
+/*           block start and h the one to the block end, the window at x is   */
+/*           then h[x - radius] and g[x + radius], 3 compares per pixel and   */
+/*           direction for any size. The vertical pass works on whole rows    */
+/*           with SSE2 (morph_rows), the horizontal pass per row. Pixels      */
+/*           closer than rx / ry to the edge are copied like image_filter.    */
+/*           Open is erode then dilate, close is dilate then erode.           */
 /******************************************************************************/
 /* Variable Definitions                                                       */
 /* Variable Name          Type     Description                                */
-/* pict[][]               int      array address                              */
-/* r                      int *    # of rows pointer                          */
-/* c                      int *    # of column pointer                        */
-/* max                    int      maximum pixel value                        */
-/* i                      int      loop counter                               */
-/* j                      int      loop counter                               */
-/* line[200]              char     string                                     */
-/* in                     FILE *   input file pointer                         */
+/* rx, ry                 int      half width and half height of rectangle    */
+/* dilate                 int      1 = max, 0 = min                           */
+/* g, h                   int *    vertical g and h of every row, h becomes   */
+/*                                 the result of the vertical pass            */
+/* gr, hr                 int *    horizontal g and h of one row              */
 /******************************************************************************/
 /* Source Code:                                                               */
-void read_pict(picture *pict, int *r, int *c)
+void morph_rows(const int *a, const int *b, int *out, int c, int dilate)
 {
-	int i, j, max;
-	FILE *in;
-	char line[200];
+	__m128i x, y, m;
+	int j;
 
-	in = fopen("original.pgm", "r");	// f16 image
-	if (in == NULL)
+	/* SSE2 has no 32 bit min/max, select by compare */
+	for (j = 0; j + 4 <= c; j += 4)
 	{
-		printf("Error reading original.pgm\n");
-		exit(1);
+		x = _mm_loadu_si128((const __m128i*)(a + j));
+		y = _mm_loadu_si128((const __m128i*)(b + j));
+		m = dilate ? _mm_cmpgt_epi32(x, y) : _mm_cmpgt_epi32(y, x);
+		_mm_storeu_si128((__m128i*)(out + j), _mm_or_si128(_mm_and_si128(m, x), _mm_andnot_si128(m, y)));
 	}
+	for (; j < c; j++)
+		out[j] = dilate ? (a[j] > b[j] ? a[j] : b[j]) : (a[j] < b[j] ? a[j] : b[j]);
+	return;
+}
 
-	fgets(line, 199, in); // get PGM Type
+void morph_filter(picture *pict, int r, int c, int rx, int ry, int dilate, picture *new_pict)
+{
+	const int wy = 2 * ry + 1, wx = 2 * rx + 1, s = pict->col;
+	int *g, *h;
+	int i, j, k, last;
 
-	line[strlen(line) - 1] = '\0';  // get rid of '\n'
+	/*  copy edges                                                                */
+	for (i = 0; i < r; i++)
+		for (j = 0; j < c; j++)
+			if (i < ry || i >= r - ry || j < rx || j >= c - rx)
+				new_pict->data[i*new_pict->col + j] = pict->data[i*pict->col + j];
+	if (r <= 2 * ry || c <= 2 * rx)
+		return;
 
-	if (strcmp(line, "P2") != 0)
+	g = (int*)malloc(2 * (size_t)r * s * sizeof(int));
+	if (g == NULL)
 	{
-		printf("Cannot process %s PGM format, only P2 type\n", line);
-		exit(2);
+		printf("creating morphology buffer failed\n");
+		return;
 	}
+	h = g + (size_t)r * s;
 
-	fgets(line, 199, in); // get comment
+	/*  vertical g and h, one block of wy rows per step                           */
+#pragma omp parallel for private(i, last)
+	for (k = 0; k < r; k += wy)
+	{
+		last = k + wy < r ? k + wy - 1 : r - 1;
+		memcpy(g + (size_t)k * s, pict->data + (size_t)k * s, c * sizeof(int));
+		for (i = k + 1; i <= last; i++)
+			morph_rows(g + (size_t)(i - 1) * s, pict->data + (size_t)i * s, g + (size_t)i * s, c, dilate);
+		memcpy(h + (size_t)last * s, pict->data + (size_t)last * s, c * sizeof(int));
+		for (i = last - 1; i >= k; i--)
+			morph_rows(h + (size_t)(i + 1) * s, pict->data + (size_t)i * s, h + (size_t)i * s, c, dilate);
+	}
 
-	fscanf(in, "%d %d", c, r); // get size width x height
+	/*  vertical result of row i into h row i - ry, nobody else reads that row    */
+#pragma omp parallel for
+	for (i = ry; i < r - ry; i++)
+		morph_rows(h + (size_t)(i - ry) * s, g + (size_t)(i + ry) * s, h + (size_t)(i - ry) * s, c, dilate);
 
-	fscanf(in, "%d", &max); // get maximum pixel value
+	/*  horizontal pass                                                           */
+#pragma omp parallel private(i, j)
+	{
+		int *gr = (int*)malloc(2 * (size_t)c * sizeof(int));
+		int *hr = gr + c;
+		const int *v;
+		int a, b;
 
-	for (i = 0; i < *r; i++)
-		for (j = 0; j < *c; j++)
-			fscanf(in, "%d", &pict->data[i*pict->col + j]);
-	fclose(in);
+#pragma omp for
+		for (i = ry; i < r - ry; i++)
+		{
+			v = h + (size_t)(i - ry) * s;
+			for (j = 0; j < c; j++)
+				gr[j] = j % wx == 0 ? v[j] : dilate ? (gr[j - 1] > v[j] ? gr[j - 1] : v[j]) :
+				(gr[j - 1] < v[j] ? gr[j - 1] : v[j]);
+			for (j = c - 1; j >= 0; j--)
+				hr[j] = j % wx == wx - 1 || j == c - 1 ? v[j] : dilate ? (hr[j + 1] > v[j] ? hr[j + 1] : v[j]) :
+				(hr[j + 1] < v[j] ? hr[j + 1] : v[j]);
+			for (j = rx; j < c - rx; j++)
+			{
+				a = hr[j - rx];
+				b = gr[j + rx];
+				new_pict->data[i*new_pict->col + j] = dilate ? (a > b ? a : b) : (a < b ? a : b);
+			}
+		}
+		free(gr);
+	}
 
+	free(g);
 	return;
-	/* End read_pict function                                                     */
+	/* End morph_filter function                                                  */
 }
 
-/* Begin image_filter function                                                */
+/* Begin morph_open_close function                                            */
 /******************************************************************************/
-/* Purpose : This function filter the image and create a new image            */
+/* Purpose : Open (erode then dilate) or close (dilate then erode) with the   */
+/*           same rectangle, the first result goes to a temporary picture.    */
+/*           A band needs 2 ry rows of halo, see op_halo.                     */
+/******************************************************************************/
+/* Source Code:                                                               */
+void morph_open_close(picture *pict, int r, int c, int rx, int ry, int close, picture *new_pict)
+{
+	picture tmp;
+
+	tmp.row = r;
+	tmp.col = pict->col;
+	tmp.data = (int*)malloc((size_t)r * tmp.col * sizeof(int));
+	if (tmp.data == NULL)
+	{
+		printf("creating morphology picture failed\n");
+		return;
+	}
+	morph_filter(pict, r, c, rx, ry, close, &tmp);
+	morph_filter(&tmp, r, c, rx, ry, !close, new_pict);
+	free(tmp.data);
+	return;
+	/* End morph_open_close function                                              */
+}
+
+/* Begin fixed_kernel function                                                */
+/******************************************************************************/
+/* Purpose : Scale the filter to integers for image_filter_fixed. The filter  */
+/*           is exact if every value times 2^shift is an integer for some     */
+/*           shift up to FIX_MAX_SHIFT, then the integer path gives the same  */
+/*           picture as image_filter (the sum and coeff are scaled alike).    */
+/*           Otherwise values are rounded at FIX_SHIFT and fk->exact is 0.    */
+/*           Returns 1 if the integer path can be used: 8 bit pictures        */
+/*           (maxval up to 255) and no int overflow.                          */
 /******************************************************************************/
 /* Variable Definitions                                                       */
 /* Variable Name          Type     Description                                */
-/* pict[][]               int      array address                              */
-/* new_pict[][]           int      array address                              */
-/* r                      int      # of rows                                  */
-/* c                      int      # of column                                */
-/* i                      int      loop counter                               */
-/* j                      int      loop counter                               */
-/* m                      int      loop counter                               */
-/* n                      int      loop counter                               */
-/* coeff                  double   coefficient                                */
-/* sum                    double   sum                                        */
+/* maxval                 int      maximum pixel value of the picture         */
+/* fk                     fixed_filter *  integer filter, shift and coeff     */
+/* scaled                 double   filter value times 2^shift                 */
+/* total                  double   sum of |integer filter|                    */
 /******************************************************************************/
 /* Source Code:                                                               */
-void image_filter(picture *pict, int r, int c, double filter[][FILTER_SIZE],
-	picture *new_pict)
+int fixed_kernel(double filter[][FILTER_SIZE], int maxval, fixed_filter *fk)
 {
-	double coeff = 0;
-	double sum;
-	int i, j, m, n;
+	double scaled, total;
+	int i, j, s;
+
+	fk->exact = 0;
+	for (s = 0; s <= FIX_MAX_SHIFT && !fk->exact; s++)
+	{
+		fk->exact = 1;
+		for (i = 0; i < FILTER_SIZE; i++)
+			for (j = 0; j < FILTER_SIZE; j++)
+			{
+				scaled = ldexp(filter[i][j], s);
+				if (scaled != floor(scaled) || fabs(scaled) > 32767)
+					fk->exact = 0;
+			}
+	}
+	fk->shift = fk->exact ? s - 1 : FIX_SHIFT;
+
+	fk->coeff = 0;
+	total = 0;
+	for (i = 0; i < FILTER_SIZE; i++)
+		for (j = 0; j < FILTER_SIZE; j++)
+		{
+			fk->k[i][j] = (int)floor(ldexp(filter[i][j], fk->shift) + 0.5);
+			fk->coeff += fk->k[i][j];
+			total += fabs((double)fk->k[i][j]);
+		}
+
+	/* 16 bit lanes if the sum can not leave int16 */
+	fk->lanes16 = total * maxval <= 32767;
+	return maxval <= 255 && total * maxval < 2147483647.0;
+	/* End fixed_kernel function                                                  */
+}
+
+/* Begin image_filter_fixed function                                          */
+/******************************************************************************/
+/* Purpose : image_filter in integers, for 8 bit pictures. The sum of 8      */
+/*           pixels is done at once in SSE2 16 bit lanes when fk->lanes16,    */
+/*           else in int per pixel. Rounding follows image_filter: the sum    */
+/*           and the division by coeff are both truncated toward zero.        */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* acc                    __m128i  sums of 8 pixels                           */
+/* sum[]                  int      sums of 8 pixels, scaled by 2^shift        */
+/* t                      int      sum after removing the scale               */
+/******************************************************************************/
+/* Source Code:                                                               */
+void image_filter_fixed(picture *pict, int r, int c, fixed_filter *fk, picture *new_pict)
+{
+	const int scale = 1 << fk->shift;
+	int i, j, m, n, l, t;
+	int sum[8];
+	__m128i acc, pix;
+	const int *src;
 
 	/*  copy edges                                                                */
 	for (i = 0; i < r; i++)
@@ -340,80 +3395,197 @@ void image_filter(picture *pict, int r, int c, double filter[][FILTER_SIZE],
 		new_pict->data[(r - 1)*new_pict->col + j] = pict->data[(r - 1)*pict->col + j];
 	}
 
-	/*  compute coefficient                                                       */
-	for (i = 0; i < FILTER_SIZE; i++)
-		for (j = 0; j < FILTER_SIZE; j++)
-			coeff += filter[i][j];
-
-	/*  filter the image                                                          */
+	/*  filter the image, 8 pixels per step                                       */
+#pragma omp parallel for private(j, m, n, l, t, sum, acc, pix, src)
 	for (i = 1; i < r - 1; i++)
-		for (j = 1; j < c - 1; j++)
+		for (j = 1; j < c - 1; j += 8)
 		{
-			sum = 0;
-			for (m = 0; m < FILTER_SIZE; m++)
-				for (n = 0; n < FILTER_SIZE; n++)
-					sum += pict->data[(i + (m - 1))*pict->col + (j + (n - 1))] * filter[m][n];
-			new_pict->data[i*new_pict->col + j] = (int)sum;
+			if (fk->lanes16 && j + 8 <= c - 1)
+			{
+				acc = _mm_setzero_si128();
+				for (m = 0; m < FILTER_SIZE; m++)
+					for (n = 0; n < FILTER_SIZE; n++)
+						if (fk->k[m][n] != 0)
+						{
+							src = pict->data + (i + (m - 1))*pict->col + (j + (n - 1));
+							pix = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)src),
+								_mm_loadu_si128((const __m128i*)(src + 4)));
+							acc = _mm_add_epi16(acc, _mm_mullo_epi16(pix, _mm_set1_epi16((short)fk->k[m][n])));
+						}
+				_mm_storeu_si128((__m128i*)sum, _mm_srai_epi32(_mm_unpacklo_epi16(acc, acc), 16));
+				_mm_storeu_si128((__m128i*)(sum + 4), _mm_srai_epi32(_mm_unpackhi_epi16(acc, acc), 16));
+			}
+			else
+			{
+				for (l = 0; l < 8 && j + l < c - 1; l++)
+				{
+					sum[l] = 0;
+					for (m = 0; m < FILTER_SIZE; m++)
+						for (n = 0; n < FILTER_SIZE; n++)
+							sum[l] += pict->data[(i + (m - 1))*pict->col + (j + l + (n - 1))] * fk->k[m][n];
+				}
+			}
+
+			/*  (int)sum, divide by coeff and check for pixel > 255 and pixel < 0      */
+			for (l = 0; l < 8 && j + l < c - 1; l++)
+			{
+				t = sum[l] / scale;
+				if (fk->coeff != 0)
+					t = (int)((long long)t * scale / fk->coeff);
+				new_pict->data[i*new_pict->col + j + l] = t < 0 ? 0 : t > 255 ? 255 : t;
+			}
 		}
 
-	if (coeff != 0)
+	return;
+	/* End image_filter_fixed function                                            */
+}
+
+/* Begin validate_fixed function                                              */
+/******************************************************************************/
+/* Purpose : Filter the picture with image_filter and image_filter_fixed and  */
+/*           report the largest difference per pixel, for -validate.          */
+/******************************************************************************/
+/* Source Code:                                                               */
+void validate_fixed(picture_pool *pool, filter_job *job, picture *pict)
+{
+	picture ref, fix;
+	fixed_filter fk;
+	int i, j, d, maxdiff = 0, ndiff = 0, usable;
+
+	usable = fixed_kernel(job->flt, job->maxval, &fk);
+	if (PicturePoolNew(pool, &ref, job->height, job->width, 0) != 1 ||
+		PicturePoolNew(pool, &fix, job->height, job->width, 0) != 1)
 	{
-		for (i = 1; i < r - 1; i++)
-			for (j = 1; j < c - 1; j++)
-				new_pict->data[i*new_pict->col + j] = (int)(new_pict->data[i*new_pict->col + j] / coeff);
+		printf("creating validate picture matrix failed\n");
+		return;
 	}
 
-	/*  check for pixel > 255 and pixel < 0                                       */
-	for (i = 1; i < r - 1; i++)
-		for (j = 1; j < c - 1; j++)
+	image_filter(pict, job->height, job->width, job->flt, &ref);
+	if (usable)
+		image_filter_fixed(pict, job->height, job->width, &fk, &fix);
+	for (i = 0; i < job->height && usable; i++)
+		for (j = 0; j < job->width; j++)
 		{
-			if (new_pict->data[i*new_pict->col + j] < 0)
-				new_pict->data[i*new_pict->col + j] = 0;
-			else if (new_pict->data[i*new_pict->col + j] > 255)
-				new_pict->data[i*new_pict->col + j] = 255;
+			d = abs(ref.data[i*ref.col + j] - fix.data[i*fix.col + j]);
+			if (d > 0)
+				ndiff++;
+			if (d > maxdiff)
+				maxdiff = d;
 		}
 
+	/* exact only if no pixel differs, whatever fixed_kernel expected */
+	if (!usable)
+		printf("validate: maximum value %d or filter too large for int, double only\n", job->maxval);
+	else
+		printf("validate: filter %s at shift %d, %s lanes, max difference %d, %d pixels differ\n",
+			ndiff == 0 ? "exact" : fk.exact ? "NOT exact" : "rounded", fk.shift,
+			fk.lanes16 ? "16 bit" : "32 bit", maxdiff, ndiff);
+
+	PictureRelease(pool, &ref);
+	PictureRelease(pool, &fix);
 	return;
-	/* End image_filter function                                                  */
+	/* End validate_fixed function                                                */
 }
 
 /* Begin write_pict function                                                  */
 /******************************************************************************/
-/* Purpose : This function write the filtered image to new.pgm                */
+/* Purpose : This function write the filtered image to fname                  */
 /******************************************************************************/
 /* Variable Definitions                                                       */
 /* Variable Name          Type     Description                                */
+/* fname                  char *   file name (new.pgm)                        */
 /* pict[][]               int      array address                              */
-/* new_pict[][]           int      array address                              */
 /* r                      int      # of rows                                  */
 /* c                      int      # of column                                */
-/* i                      int      loop counter                               */
-/* j                      int      loop counter                               */
+/* maxval                 int      maximum pixel value written in the header  */
 /* out                    FILE *   output FILE pointer                        */
 /******************************************************************************/
 /* Source Code:                                                               */
-void write_pict(picture *pict, int r, int c)
+void write_pict(const char *fname, picture *pict, int r, int c, int maxval)
+{
+	FILE *out;
+
+	TRACE_BEGIN("write_pict");
+
+	out = write_begin(fname, r, c, maxval);
+	if (out != NULL)
+	{
+		write_rows(out, pict, 0, r, c);
+		write_end(out);
+	}
+
+	TRACE_END("write_pict");
+	return;
+	/* End write_pict function                                                    */
+}
+
+/* Begin write_begin, write_rows, write_end functions                         */
+/******************************************************************************/
+/* Purpose : write_pict in steps, so rows can be written as they are ready.   */
+/*           write_begin opens fname and writes the header, write_rows writes */
+/*           n rows from row first and write_end closes the file. Every pixel */
+/*           is formatted as "%5d" by hand into a row buffer, one fwrite per  */
+/*           row, values of 5 digits and more get a space so they stay apart. */
+/******************************************************************************/
+/* Variable Definitions                                                       */
+/* Variable Name          Type     Description                                */
+/* line                   char *   formatted row                              */
+/* q                      char *   end of line                                */
+/* v                      int      pixel value                                */
+/******************************************************************************/
+/* Source Code:                                                               */
+FILE *write_begin(const char *fname, int r, int c, int maxval)
 {
-	int i, j;
 	FILE *out;
 
-	out = fopen("new.pgm", "w");
+	out = fopen(fname, "w");
+	if (out == NULL)
+	{
+		printf("Error writing %s\n", fname);
+		return NULL;
+	}
 
 	fprintf(out, "P2\n");
-	fprintf(out, "# new.pgm\n");
-	fprintf(out, "%d %d\n", r, c);
-	fprintf(out, "255\n");
+	fprintf(out, "# %s\n", fname);
+	fprintf(out, "%d %d\n", c, r); // width x height
+	fprintf(out, "%d\n", maxval);
+	return out;
+}
 
-	for (i = 0; i < r; i++)
+void write_rows(FILE *out, picture *pict, int first, int n, int c)
+{
+	char *line = (char*)malloc(c * 12 + 2);
+	char *q;
+	int i, j, k, v;
+
+	for (i = first; i < first + n; i++)
 	{
+		q = line;
 		for (j = 0; j < c; j++)
-			fprintf(out, "%5d", pict->data[i*pict->col + j]);
-		fprintf(out, "\n");
+		{
+			v = pict->data[i*pict->col + j];
+			if (v >= 0 && v < 10000)
+			{
+				q[4] = '0' + v % 10;
+				for (k = 3, v /= 10; k >= 0; k--, v /= 10)
+					q[k] = v ? '0' + v % 10 : ' ';
+				q += 5;
+			}
+			else
+				q += sprintf(q, " %4d", v);
+		}
+		*q++ = '\n';
+		fwrite(line, 1, q - line, out);
 	}
+	free(line);
+	return;
+}
 
+void write_end(FILE *out)
+{
 	fclose(out);
 	return;
-	/* End write_pict function                                                    */
+	/* End write_begin, write_rows, write_end functions                           */
 }
 
 